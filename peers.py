@@ -1,8 +1,8 @@
 def top_left(s):
-    return ((s / 27) * 27) + (((s % 9) / 3) * 3)
+    return ((s // 27) * 27) + (((s % 9) // 3) * 3)
 
 def hor_left(s):
-    return (s / 9) * 9
+    return (s // 9) * 9
 
 def ver_top(s):
     return s % 9
@@ -28,6 +28,13 @@ def ver_peers(s):
             vt + 27, vt + 36, vt + 45,
             vt + 54, vt + 63, vt + 72]
 
+def units():
+    rows = [hor_peers(r * 9) for r in range(0, 9)]
+    cols = [ver_peers(c) for c in range(0, 9)]
+    boxes = [unit_peers(b // 3 * 27 + b % 3 * 3) for b in range(0, 9)]
+
+    return rows + cols + boxes
+
 def peers(s):
     peers = set(unit_peers(s) + hor_peers(s) + ver_peers(s))
     peers.remove(s)
@@ -36,5 +43,11 @@ def peers(s):
 
 
 if __name__ == '__main__':
-    for i in range(0, 81):
-        print("{ " + ", ".join(str(p).rjust(2, ' ') for p in peers(i)) + " }, ")
+    import sys
+
+    if 'units' in sys.argv:
+        for u in units():
+            print("{ " + ", ".join(str(s).rjust(2, ' ') for s in u) + " }, ")
+    else:
+        for i in range(0, 81):
+            print("{ " + ", ".join(str(p).rjust(2, ' ') for p in peers(i)) + " }, ")
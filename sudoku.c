@@ -1,16 +1,108 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "sudoku.h"
+
+#ifdef SUDOKU_LIBRARY
+// The library leaves out the command line, and with it the only callers of
+// some engines and tools.
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-const-variable"
+#endif
 
 // https://norvig.com/sudoku.html
 // https://github.com/norvig/pytudes/blob/master/py/sudoku.py
 
-static void print_grid(uint_fast16_t grid[81]);
+#ifndef SUDOKU_LIBRARY
 
 static void run_tests();
 
-static void profile_example_puzzles();
+struct engine;
+struct solution_cache;
+
+struct solve_options {
+  const struct engine *engine;
+  int search_threads;
+  _Bool report_speedup;
+  // When positive, count solutions up to this limit instead of solving.
+  int solution_limit;
+  _Bool report_stats;
+  // Solutions are looked up by canonical form when set.
+  struct solution_cache *cache;
+  // Records are read or written in the packed format when set.
+  _Bool packed_input;
+  _Bool packed_output;
+  // Copies puzzles into the output format instead of solving them.
+  _Bool convert;
+  // The budget of each solve, zero for no limit.
+  uint64_t node_budget;
+  double deadline_seconds;
+};
+
+static _Bool solve_puzzle_file(const char *path, int thread_count, const struct solve_options *options);
+
+// Puzzles that ran out of their budget, over all threads.
+static atomic_long timed_out_count;
+
+enum benchmark_format { BENCHMARK_TEXT, BENCHMARK_CSV, BENCHMARK_JSON };
+
+struct benchmark_options {
+  const struct engine *engine;
+  int warmup;
+  int repetitions;
+  enum benchmark_format format;
+  // Times canonicalize instead of solving.
+  _Bool canonicalize;
+  struct solution_cache *cache;
+  // Run every propagation level, value order or branching in turn.
+  _Bool all_propagation_levels;
+  _Bool all_value_orders;
+  _Bool all_branchings;
+};
+
+static _Bool run_benchmark(const char *path, const struct benchmark_options *options);
+
+static _Bool generate_puzzles(long count, int target_clues, uint64_t seed, int thread_count);
+
+static _Bool serve(const char *address, int thread_count, const struct solve_options *options);
+
+struct coordinator_stats {
+  long shards;
+  long lines;
+  // Lines answered with an empty line.
+  long empty;
+  // Lines answered with a partial grid, having run out of budget.
+  long timed_out;
+  long retries;
+};
+
+static _Bool coordinate(const char *path, int out_fd, int worker_count, const char *worker_command,
+			const struct solve_options *options, struct coordinator_stats *stats);
+
+#endif
 
 /*
 
@@ -30,6 +122,12 @@ static void profile_example_puzzles();
 
 #define NUMBER_OF_SQUARES 81
 #define NUMBER_OF_PEERS 20
+#define NUMBER_OF_UNITS 27
+#define NUMBER_OF_UNIT_SQUARES 9
+
+// Grids scanned by search_target are padded with empty squares to a whole
+// number of 256 bit vectors, which is three cache lines.
+#define GRID_SIZE 96
 
 static const uint_fast8_t PEERS[][NUMBER_OF_PEERS] =
   {
@@ -116,212 +214,5559 @@ static const uint_fast8_t PEERS[][NUMBER_OF_PEERS] =
    {  8, 17, 26, 35, 44, 53, 60, 61, 62, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79 }, 
   };
 
-static inline void default_grid_values(uint_fast16_t grid[81]) {
+// Rows, then columns, then boxes.
+static const uint_fast8_t UNITS[][NUMBER_OF_UNIT_SQUARES] =
+  {
+   {  0,  1,  2,  3,  4,  5,  6,  7,  8 }, 
+   {  9, 10, 11, 12, 13, 14, 15, 16, 17 }, 
+   { 18, 19, 20, 21, 22, 23, 24, 25, 26 }, 
+   { 27, 28, 29, 30, 31, 32, 33, 34, 35 }, 
+   { 36, 37, 38, 39, 40, 41, 42, 43, 44 }, 
+   { 45, 46, 47, 48, 49, 50, 51, 52, 53 }, 
+   { 54, 55, 56, 57, 58, 59, 60, 61, 62 }, 
+   { 63, 64, 65, 66, 67, 68, 69, 70, 71 }, 
+   { 72, 73, 74, 75, 76, 77, 78, 79, 80 }, 
+   {  0,  9, 18, 27, 36, 45, 54, 63, 72 }, 
+   {  1, 10, 19, 28, 37, 46, 55, 64, 73 }, 
+   {  2, 11, 20, 29, 38, 47, 56, 65, 74 }, 
+   {  3, 12, 21, 30, 39, 48, 57, 66, 75 }, 
+   {  4, 13, 22, 31, 40, 49, 58, 67, 76 }, 
+   {  5, 14, 23, 32, 41, 50, 59, 68, 77 }, 
+   {  6, 15, 24, 33, 42, 51, 60, 69, 78 }, 
+   {  7, 16, 25, 34, 43, 52, 61, 70, 79 }, 
+   {  8, 17, 26, 35, 44, 53, 62, 71, 80 }, 
+   {  0,  1,  2,  9, 10, 11, 18, 19, 20 }, 
+   {  3,  4,  5, 12, 13, 14, 21, 22, 23 }, 
+   {  6,  7,  8, 15, 16, 17, 24, 25, 26 }, 
+   { 27, 28, 29, 36, 37, 38, 45, 46, 47 }, 
+   { 30, 31, 32, 39, 40, 41, 48, 49, 50 }, 
+   { 33, 34, 35, 42, 43, 44, 51, 52, 53 }, 
+   { 54, 55, 56, 63, 64, 65, 72, 73, 74 }, 
+   { 57, 58, 59, 66, 67, 68, 75, 76, 77 }, 
+   { 60, 61, 62, 69, 70, 71, 78, 79, 80 }, 
+  };
+
+static inline void default_grid_values(uint16_t grid[81]) {
   for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
     grid[i] = 0x1FF;
   }
 }
 
-static _Bool eliminate_from_peers(uint_fast16_t grid[81], int square, uint_fast16_t value) {
-  for (int i = 0; i < NUMBER_OF_PEERS; ++i) {
-    uint_fast16_t grid_value = grid[PEERS[square][i]];
+// Building with -DSUDOKU_STATS makes the engines count the work each solve
+// does into solve_stats, which belongs to the solving thread and is reset
+// at the start of every solve. Counters an engine has no equivalent for
+// stay at zero. Without the flag the counting compiles away.
+#ifdef SUDOKU_STATS
 
-    if ((grid_value & value) == 0) {
-      continue;
-    }
-    
-    grid_value &= ~value;
-    
-    if (grid_value == 0) {
-      return false;
-    }
+#define SOLVE_STATS(COUNTER, MAXIMUM)		\
+  COUNTER(nodes)				\
+  COUNTER(guesses)				\
+  COUNTER(backtracks)				\
+  COUNTER(assigns)				\
+  COUNTER(propagations)				\
+  COUNTER(peer_scans)				\
+  COUNTER(hidden_singles)			\
+  MAXIMUM(max_queue)				\
+  MAXIMUM(max_depth)
 
-    grid[PEERS[square][i]] = grid_value;
+#define STATS_FIELD(name) uint64_t name;
 
-    if ((grid_value & (grid_value - 1)) == 0 && !eliminate_from_peers(grid, PEERS[square][i], grid_value)) {
-      return false;
-    }
-  }
-  
-  return true;
+struct solve_stats {
+  SOLVE_STATS(STATS_FIELD, STATS_FIELD)
+};
+
+static _Thread_local struct solve_stats solve_stats;
+
+#define STATS_ADD(name, n) (solve_stats.name += (uint64_t)(n))
+#define STATS_MAX(name, n) (solve_stats.name = solve_stats.name > (uint64_t)(n) ? solve_stats.name : (uint64_t)(n))
+#define STATS_RESET() (solve_stats = (struct solve_stats){ 0 })
+
+static void add_stats(struct solve_stats *total, const struct solve_stats *stats) {
+#define ADD_COUNTER(name) total->name += stats->name;
+#define ADD_MAXIMUM(name) total->name = total->name > stats->name ? total->name : stats->name;
+  SOLVE_STATS(ADD_COUNTER, ADD_MAXIMUM)
+#undef ADD_COUNTER
+#undef ADD_MAXIMUM
 }
 
-static _Bool assign(uint_fast16_t grid[81], int square, uint_fast16_t value) {
-  grid[square] = value;
-  
-  return eliminate_from_peers(grid, square, value);
+static void print_stats(FILE *file, const struct solve_stats *stats) {
+  const char *separator = "";
+
+#define PRINT_STAT(name) fprintf(file, "%s" #name " %llu", separator, (unsigned long long)stats->name), separator = " ";
+  SOLVE_STATS(PRINT_STAT, PRINT_STAT)
+#undef PRINT_STAT
 }
 
-static _Bool search_target(const uint_fast16_t grid[81], int *square) {
-  static const int none_found = 10;
-  int min_remaining = none_found;
-  int min_square = 0;
+static pthread_mutex_t total_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct solve_stats total_stats;
 
-  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
-    const int values_remaining = __builtin_popcount(grid[i]);
+// Prints the stats of the puzzle this thread just solved to stderr, and
+// adds them to the totals.
+static void report_stats(const char *puzzle) {
+  pthread_mutex_lock(&total_stats_lock);
 
-    if (values_remaining > 1 && values_remaining < min_remaining) {
-      min_remaining = values_remaining;
-      min_square = i;
+  fprintf(stderr, "%.81s ", puzzle);
+  print_stats(stderr, &solve_stats);
+  fputc('\n', stderr);
+  add_stats(&total_stats, &solve_stats);
 
-      if (values_remaining == 2) {
-	break;
-      }
-    }
-  }
+  pthread_mutex_unlock(&total_stats_lock);
+}
 
-  if (min_remaining == none_found) {
+#else
+
+#define STATS_ADD(name, n) ((void)0)
+#define STATS_MAX(name, n) ((void)0)
+#define STATS_RESET() ((void)0)
+
+#endif
+
+/*
+
+  Budgets
+
+  A solve can be limited to a number of search nodes and a wall clock
+  deadline, so one adversarial puzzle cannot hold up the rest of a batch.
+  The norvig search and dancing links spend a node of the budget on every
+  guess, and look at the clock every DEADLINE_CHECK_INTERVAL of them. Once
+  either runs out they stop and return the grid as propagation left it
+  before the first guess, with exhausted set so callers can tell a timeout
+  from a puzzle without solutions. The bitboard and generic engines do not
+  take budgets.
+
+ */
+
+#define DEADLINE_CHECK_INTERVAL 64
+
+struct solve_budget {
+  uint64_t nodes_left;
+  // In monotonic seconds, or zero for none.
+  double deadline;
+  _Bool exhausted;
+};
+
+static _Thread_local struct solve_budget solve_budget = { UINT64_MAX, 0, false };
+
+static inline double monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+// Gives the solves that follow on this thread a budget of max_nodes nodes
+// and max_seconds from now, where zero means no limit.
+static void start_budget(uint64_t max_nodes, double max_seconds) {
+  solve_budget = (struct solve_budget){
+    .nodes_left = max_nodes > 0 ? max_nodes : UINT64_MAX,
+    .deadline = max_seconds > 0 ? monotonic_seconds() + max_seconds : 0,
+    .exhausted = false,
+  };
+}
+
+// Takes a node from budget, or returns false once it is out of nodes or
+// past its deadline.
+static inline _Bool spend_node(struct solve_budget *budget) {
+  if (budget->nodes_left == 0 ||
+      (budget->deadline != 0 && budget->nodes_left % DEADLINE_CHECK_INTERVAL == 0 &&
+       monotonic_seconds() >= budget->deadline)) {
+    budget->nodes_left = 0;
+    budget->exhausted = true;
     return false;
   }
 
-  *square = min_square;
+  --budget->nodes_left;
 
   return true;
 }
 
-static inline void copy_grid(const uint_fast16_t src[81], uint_fast16_t dest[81]) {
+// Every grid write during solving goes through set_values, which logs the
+// previous values of the square on the trail, so backtracking undoes the
+// writes made since a branch started instead of copying the grid for each
+// branch. A logged write always removes values from a square and never
+// empties it, so a square is logged at most eight times before it is
+// undone again.
+#define TRAIL_SIZE (NUMBER_OF_SQUARES * 8)
+
+struct trail_entry {
+  uint8_t square;
+  uint16_t values;
+};
+
+struct search_frame {
+  uint8_t square;
+  uint16_t values_left;
+  uint16_t mark;
+};
+
+struct solver {
+  _Alignas(64) uint16_t grid[GRID_SIZE];
+  // When set, search tries values in random order.
+  uint64_t *random;
+  // Search gives up when this runs out.
+  uint64_t guesses_left;
+  // The budget of the solve, or NULL for none.
+  struct solve_budget *budget;
+  // With bucket branching, the squares holding each number of values, as
+  // bits over two words.
+  _Bool buckets_kept;
+  uint64_t buckets[10][2];
+  int trail_size;
+  struct trail_entry trail[TRAIL_SIZE];
+  struct search_frame stack[NUMBER_OF_SQUARES];
+};
+
+/*
+
+  Branching
+
+  search_target scans the grid for the square to branch on at every node.
+  With bucket branching the solver instead keeps every square in a bucket
+  by its number of values, moved by each set_values and undo, so the square
+  is the first one of the lowest bucket above one, which is the same square
+  the scan finds.
+
+ */
+
+enum branching { BRANCH_SCAN, BRANCH_BUCKETS };
+
+static const char *const BRANCHING_NAMES[] = { "scan", "buckets" };
+
+#define BRANCHING_COUNT ((int)(sizeof(BRANCHING_NAMES) / sizeof(BRANCHING_NAMES[0])))
+
+// Set before solving starts, by --branching.
+static enum branching branching = BRANCH_SCAN;
+
+#define COUNT_2(n) n, n + 1, n + 1, n + 2
+#define COUNT_4(n) COUNT_2(n), COUNT_2(n + 1), COUNT_2(n + 1), COUNT_2(n + 2)
+#define COUNT_6(n) COUNT_4(n), COUNT_4(n + 1), COUNT_4(n + 1), COUNT_4(n + 2)
+#define COUNT_8(n) COUNT_6(n), COUNT_6(n + 1), COUNT_6(n + 1), COUNT_6(n + 2)
+
+// The number of values in each set of values.
+static const uint8_t VALUE_COUNTS[512] = { COUNT_8(0), COUNT_8(1) };
+
+static inline void move_to_bucket(struct solver *solver, int square, uint16_t from, uint16_t to) {
+  const uint64_t bit = 1ULL << (square & 63);
+
+  solver->buckets[VALUE_COUNTS[from]][square >> 6] ^= bit;
+  solver->buckets[VALUE_COUNTS[to]][square >> 6] ^= bit;
+}
+
+static inline _Bool bucket_target(const struct solver *solver, int *square) {
+  for (int count = 2; count <= 9; ++count) {
+    if (solver->buckets[count][0] != 0) {
+      *square = __builtin_ctzll(solver->buckets[count][0]);
+      return true;
+    }
+
+    if (solver->buckets[count][1] != 0) {
+      *square = 64 + __builtin_ctzll(solver->buckets[count][1]);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static inline void init_solver(struct solver *solver, const uint16_t grid[81]) {
   for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
-    dest[i] = src[i];
+    solver->grid[i] = grid[i];
+  }
+
+  for (int i = NUMBER_OF_SQUARES; i < GRID_SIZE; ++i) {
+    solver->grid[i] = 0;
+  }
+
+  solver->random = NULL;
+  solver->guesses_left = UINT64_MAX;
+  solver->budget = NULL;
+  solver->trail_size = 0;
+  solver->buckets_kept = branching == BRANCH_BUCKETS;
+
+  if (solver->buckets_kept) {
+    memset(solver->buckets, 0, sizeof(solver->buckets));
+
+    for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+      solver->buckets[VALUE_COUNTS[grid[i]]][i >> 6] |= 1ULL << (i & 63);
+    }
   }
 }
 
-static _Bool search(uint_fast16_t grid[81]) {
-  int square = 0;
+static inline void set_values(struct solver *solver, int square, uint16_t values) {
+  struct trail_entry *entry = &solver->trail[solver->trail_size++];
 
-  if (!search_target(grid, &square)) {
-    return true;
+  entry->square = (uint8_t)square;
+  entry->values = (uint16_t)solver->grid[square];
+
+  if (solver->buckets_kept) {
+    move_to_bucket(solver, square, entry->values, values);
   }
 
-  const uint_fast16_t values = grid[square];
+  solver->grid[square] = values;
+}
 
-  for (int i = 0; i < 9; ++i) {
-    const uint_fast16_t value = 1 << i;
+static inline void undo(struct solver *solver, int mark) {
+  while (solver->trail_size > mark) {
+    const struct trail_entry *entry = &solver->trail[--solver->trail_size];
 
-    if ((values & value) == 0) {
-      continue;
+    if (solver->buckets_kept) {
+      move_to_bucket(solver, entry->square, solver->grid[entry->square], entry->values);
     }
 
-    uint_fast16_t new_grid[NUMBER_OF_SQUARES] = {0};
-    copy_grid(grid, new_grid);
+    solver->grid[entry->square] = entry->values;
+  }
+}
+
+// Clears the value of each queued square from its peers, queueing every
+// peer that is left with a single value, until the queue runs dry. A square
+// is only queued when it drops to a single value, which can happen once,
+// so the queue never holds more than NUMBER_OF_SQUARES entries. Fails as
+// soon as a square has no values left.
+static _Bool propagate(struct solver *solver, uint_fast8_t queue[NUMBER_OF_SQUARES], int queued) {
+  uint16_t *grid = solver->grid;
 
-    if (assign(new_grid, square, value) && search(new_grid)) {
-      return true;
+  for (int next = 0; next < queued; ++next) {
+    const int square = queue[next];
+    const uint16_t value = grid[square];
+
+    STATS_ADD(propagations, 1);
+    STATS_ADD(peer_scans, NUMBER_OF_PEERS);
+
+    for (int i = 0; i < NUMBER_OF_PEERS; ++i) {
+      const int peer = PEERS[square][i];
+      uint16_t grid_value = grid[peer];
+
+      if ((grid_value & value) == 0) {
+	continue;
+      }
+
+      grid_value &= ~value;
+
+      if (grid_value == 0) {
+	return false;
+      }
+
+      set_values(solver, peer, grid_value);
+
+      if ((grid_value & (grid_value - 1)) == 0) {
+	queue[queued++] = (uint_fast8_t)peer;
+	STATS_MAX(max_queue, queued);
+      }
     }
   }
 
-  return false;
+  return true;
 }
 
-static _Bool solve(const char puzzle[82], uint_fast16_t grid[81]) {
-  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
-    const char value = puzzle[i];
-    
-    if (value == '.' || value == '0') {
-      continue;
-    }
-    
-    if (value >= '1' && value <= '9') {
-      const uint_fast16_t value_to_assign = 1 << (value - 49);
+static _Bool eliminate_from_peers(struct solver *solver, int square, uint16_t value) {
+  uint_fast8_t queue[NUMBER_OF_SQUARES];
+
+  queue[0] = (uint_fast8_t)square;
+  set_values(solver, square, value);
+
+  return propagate(solver, queue, 1);
+}
+
+// Norvig's second rule: when a unit has only one place left for a value,
+// put the value there. Each sweep over the units queues its placements and
+// propagates them together, until a sweep places nothing. Fails if a unit
+// has no place left for some value.
+static _Bool place_hidden_singles(struct solver *solver) {
+  const uint16_t *grid = solver->grid;
+  uint_fast8_t queue[NUMBER_OF_SQUARES];
+  int queued;
+
+  do {
+    queued = 0;
+
+    for (int unit = 0; unit < NUMBER_OF_UNITS; ++unit) {
+      const uint_fast8_t *squares = UNITS[unit];
+      uint16_t once = 0;
+      uint16_t twice = 0;
+      uint16_t solved = 0;
+
+      for (int i = 0; i < NUMBER_OF_UNIT_SQUARES; ++i) {
+	const uint16_t values = grid[squares[i]];
 
-      if (!assign(grid, i, value_to_assign)) {
+	twice |= once & values;
+	once |= values;
+
+	if ((values & (values - 1)) == 0) {
+	  solved |= values;
+	}
+      }
+
+      if (once != 0x1FF) {
 	return false;
       }
+
+      uint16_t hidden = once & ~twice & ~solved;
+
+      while (hidden != 0) {
+	const uint16_t value = hidden & -hidden;
+	hidden &= hidden - 1;
+
+	int i = 0;
+
+	while (i < NUMBER_OF_UNIT_SQUARES && (grid[squares[i]] & value) == 0) {
+	  ++i;
+	}
+
+	// The only place went to another value placed earlier in this sweep.
+	if (i == NUMBER_OF_UNIT_SQUARES) {
+	  return false;
+	}
+
+	// Another unit may have placed the value here already.
+	if (grid[squares[i]] != value) {
+	  set_values(solver, squares[i], value);
+	  queue[queued++] = squares[i];
+	}
+      }
     }
-    else {
-      fprintf(stderr, "Invalid input: %c\n", value);
+
+    STATS_ADD(hidden_singles, queued);
+
+    if (!propagate(solver, queue, queued)) {
       return false;
     }
-  }
-  
-  return search(grid);
+  } while (queued > 0);
+
+  return true;
 }
 
-int main(int argc, char **argv) {
-  run_tests();
+/*
 
-  /*
-  //const char puzzle[] = "003020600900305001001806400008102900700000008006708200002609500800203009005010300";
-  //const char puzzle[] = "4.....8.5.3..........7......2.....6.....8.4......1.......6.3.7.5..2.....1.4......";
-  const char puzzle[] = "..1..6.9.5.....1.....3..4.6..9..7....4.6.3.7....2..9..4.6..9.....8.....5.3.4..8..";
+  Propagation Levels
 
-  uint_fast16_t grid[81] = {0};
-  default_grid_values(grid);
+  Beyond the two rules above, the engine can apply deductions that clear
+  values without placing any. Each level adds to the one before it, so the
+  search sees fewer nodes at a higher cost per node:
 
-  (void)solve(puzzle, grid);
-  */
+  intersections  When a value's places in a box all lie on one row or
+                 column, clear it from the rest of that line (pointing),
+                 and when its places on a line all lie in one box, clear it
+                 from the rest of that box (box/line reduction).
 
-  profile_example_puzzles();
+  pairs          When two squares of a unit hold the same two values, clear
+                 those from the rest of the unit (naked pairs), and when two
+                 values of a unit fit only in the same two squares, clear
+                 everything else from those squares (hidden pairs).
 
-  return 0;
+  Both are applied after hidden singles, and the singles run again after
+  any clear, until the grid stops changing.
+
+ */
+
+enum propagation { PROPAGATE_SINGLES, PROPAGATE_INTERSECTIONS, PROPAGATE_PAIRS };
+
+static const char *const PROPAGATION_NAMES[] = { "singles", "intersections", "pairs" };
+
+#define PROPAGATION_COUNT ((int)(sizeof(PROPAGATION_NAMES) / sizeof(PROPAGATION_NAMES[0])))
+
+// Set before solving starts, by --propagation.
+static enum propagation propagation = PROPAGATE_SINGLES;
+
+// Clears values from square, queueing it for propagate if it is left with
+// a single value. Fails if it is left with none.
+static inline _Bool clear_values(struct solver *solver, int square, uint16_t values,
+				 uint_fast8_t queue[NUMBER_OF_SQUARES], int *queued) {
+  const uint16_t grid_value = solver->grid[square];
+
+  if ((grid_value & values) == 0) {
+    return true;
+  }
+
+  const uint16_t left = grid_value & ~values;
+
+  if (left == 0) {
+    return false;
+  }
+
+  set_values(solver, square, left);
+
+  if ((left & (left - 1)) == 0) {
+    queue[(*queued)++] = (uint_fast8_t)square;
+  }
+
+  return true;
 }
 
+// The square at place along line, which is a row for direction 0 and a
+// column for direction 1.
+#define LINE_SQUARE(direction, line, place) ((direction) == 0 ? (line) * 9 + (place) : (place) * 9 + (line))
 
-static void print_grid(uint_fast16_t grid[81]) {
-  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
-    const uint_fast16_t values = grid[i];
+// Works from the values of the open squares of each three square segment
+// of a row or column, as they were before any clearing. Clearing only ever
+// shrinks squares, so what held then still holds, and solved squares have
+// already been cleared from their peers.
+static _Bool clear_intersections(struct solver *solver, uint_fast8_t queue[NUMBER_OF_SQUARES], int *queued) {
+  const uint16_t *grid = solver->grid;
+  uint16_t segments[2][9][3];
 
-    for (int j = 0; j < 9; ++j) {
-      if ((values & 1 << j) == 0) {
-	continue;
-      }
+  for (int direction = 0; direction < 2; ++direction) {
+    for (int line = 0; line < 9; ++line) {
+      for (int block = 0; block < 3; ++block) {
+	uint16_t open = 0;
+
+	for (int i = 0; i < 3; ++i) {
+	  const uint16_t values = grid[LINE_SQUARE(direction, line, block * 3 + i)];
 
-      printf("%d", j + 1);
+	  if ((values & (values - 1)) != 0) {
+	    open |= values;
+	  }
+	}
+
+	segments[direction][line][block] = open;
+      }
     }
+  }
+
+  for (int direction = 0; direction < 2; ++direction) {
+    for (int line = 0; line < 9; ++line) {
+      const int band = line - line % 3;
 
-    printf(" ");
+      for (int block = 0; block < 3; ++block) {
+	const uint16_t segment = segments[direction][line][block];
+	const uint16_t rest_of_line = segments[direction][line][(block + 1) % 3] | segments[direction][line][(block + 2) % 3];
+	const uint16_t rest_of_box = segments[direction][band + (line + 1) % 3][block] |
+	  segments[direction][band + (line + 2) % 3][block];
+	const uint16_t pointing = segment & ~rest_of_box;
+	const uint16_t claiming = segment & ~rest_of_line;
 
-    if ((i + 1) % 9 == 0) {
-      printf("\n");
+	for (int place = 0; pointing != 0 && place < 9; ++place) {
+	  if (place / 3 != block && !clear_values(solver, LINE_SQUARE(direction, line, place), pointing, queue, queued)) {
+	    return false;
+	  }
+	}
+
+	for (int other = band; claiming != 0 && other < band + 3; ++other) {
+	  for (int i = 0; other != line && i < 3; ++i) {
+	    if (!clear_values(solver, LINE_SQUARE(direction, other, block * 3 + i), claiming, queue, queued)) {
+	      return false;
+	    }
+	  }
+	}
+      }
     }
   }
-}
 
+  return true;
+}
 
-/*
+static _Bool clear_pairs(struct solver *solver, uint_fast8_t queue[NUMBER_OF_SQUARES], int *queued) {
+  const uint16_t *grid = solver->grid;
 
-  Logic Tests
+  for (int unit = 0; unit < NUMBER_OF_UNITS; ++unit) {
+    const uint_fast8_t *squares = UNITS[unit];
 
- */
+    for (int i = 0; i < NUMBER_OF_UNIT_SQUARES; ++i) {
+      const uint16_t pair = grid[squares[i]];
 
-static void test_can_eliminate_value_from_peers() {
-  uint_fast16_t grid[81] = {0};
-  default_grid_values(grid);
+      if (__builtin_popcount(pair) != 2) {
+	continue;
+      }
 
-  const uint_fast16_t known_value = 0x08;
-  const int square = 0;
+      for (int j = i + 1; j < NUMBER_OF_UNIT_SQUARES; ++j) {
+	if (grid[squares[j]] != pair) {
+	  continue;
+	}
 
-  grid[square] = known_value;
+	for (int k = 0; k < NUMBER_OF_UNIT_SQUARES; ++k) {
+	  if (k != i && k != j && !clear_values(solver, squares[k], pair, queue, queued)) {
+	    return false;
+	  }
+	}
+      }
+    }
 
-  assert(eliminate_from_peers(grid, square, known_value));
-  assert(grid[square] == known_value);
+    // The places of each value in the unit, as a bit per unit square.
+    // Solved squares count, since clears earlier in this sweep may have
+    // solved squares that are not yet cleared from their peers.
+    uint16_t places[9] = {0};
 
-  for (int i = 1; i < NUMBER_OF_SQUARES; ++i) {
-    if ((i > 0 && i < 12) || (i > 17 && i < 21) ||
-	i == 27 || i == 36 || i == 45 ||
-	i == 54 || i == 63 || i == 72) {
-      assert(grid[i] == 0x1F7);
+    for (int i = 0; i < NUMBER_OF_UNIT_SQUARES; ++i) {
+      for (uint16_t values = grid[squares[i]]; values != 0; values &= values - 1) {
+	places[__builtin_ctz(values)] |= (uint16_t)(1 << i);
+      }
     }
-    else {
-      assert(grid[i] == 0x1FF);
+
+    for (int v = 0; v < 9; ++v) {
+      if (__builtin_popcount(places[v]) != 2) {
+	continue;
+      }
+
+      for (int w = v + 1; w < 9; ++w) {
+	if (places[w] != places[v]) {
+	  continue;
+	}
+
+	const uint16_t others = (uint16_t)(0x1FF & ~(1 << v | 1 << w));
+
+	for (uint16_t where = places[v]; where != 0; where &= where - 1) {
+	  if (!clear_values(solver, squares[__builtin_ctz(where)], others, queue, queued)) {
+	    return false;
+	  }
+	}
+      }
     }
   }
+
+  return true;
 }
 
-static void test_eliminate_only_modifies_peers_with_values_to_remove() {
-  uint_fast16_t grid[81] = {0};
-  default_grid_values(grid);
+// Places hidden singles, then applies the deductions of the propagation
+// level until none of them changes the grid.
+static _Bool deduce(struct solver *solver) {
+  if (!place_hidden_singles(solver)) {
+    return false;
+  }
 
-  const uint_fast16_t known_value = 0x01;
-  const uint_fast16_t peer_value = 0x02;
-  const int square = 0;
-  const int peer = 4;
+  while (propagation > PROPAGATE_SINGLES) {
+    uint_fast8_t queue[NUMBER_OF_SQUARES];
+    int queued = 0;
+    const int mark = solver->trail_size;
 
-  grid[square] = known_value;
-  grid[peer] = peer_value;
+    if (!clear_intersections(solver, queue, &queued)) {
+      return false;
+    }
 
-  assert(eliminate_from_peers(grid, square, known_value));
-  assert(grid[square] == known_value);
-  assert(grid[peer] == peer_value);
+    if (propagation >= PROPAGATE_PAIRS && !clear_pairs(solver, queue, &queued)) {
+      return false;
+    }
+
+    if (solver->trail_size == mark) {
+      break;
+    }
+
+    if (!propagate(solver, queue, queued) || !place_hidden_singles(solver)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static _Bool assign(struct solver *solver, int square, uint16_t value) {
+  STATS_ADD(assigns, 1);
+
+  return eliminate_from_peers(solver, square, value) && deduce(solver);
+}
+
+static _Bool scalar_search_target(const uint16_t grid[GRID_SIZE], int *square) {
+  static const int none_found = 10;
+  int min_remaining = none_found;
+  int min_square = 0;
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const int values_remaining = __builtin_popcount(grid[i]);
+
+    if (values_remaining > 1 && values_remaining < min_remaining) {
+      min_remaining = values_remaining;
+      min_square = i;
+
+      if (values_remaining == 2) {
+	break;
+      }
+    }
+  }
+
+  if (min_remaining == none_found) {
+    return false;
+  }
+
+  *square = min_square;
+
+  return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The vector versions give each square a 16 bit key of its candidate count
+// above its index, or 0xFFFF if it is solved or padding, so the smallest key
+// is the first square with the fewest values left, as in the scalar scan.
+// Counts come from a nibble lookup per byte; the high byte of a square only
+// ever holds value 9.
+__attribute__((target("sse4.1")))
+static inline __m128i sse_search_keys(__m128i values, __m128i index) {
+  const __m128i nibble_counts = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+
+  __m128i counts = _mm_add_epi8(_mm_shuffle_epi8(nibble_counts, _mm_and_si128(values, nibble)),
+				_mm_shuffle_epi8(nibble_counts, _mm_and_si128(_mm_srli_epi16(values, 4), nibble)));
+  counts = _mm_add_epi16(_mm_and_si128(counts, _mm_set1_epi16(0xFF)), _mm_srli_epi16(counts, 8));
+
+  const __m128i open = _mm_cmpgt_epi16(counts, _mm_set1_epi16(1));
+
+  return _mm_or_si128(_mm_or_si128(_mm_slli_epi16(counts, 8), index), _mm_andnot_si128(open, _mm_set1_epi16(-1)));
+}
+
+__attribute__((target("sse4.1")))
+static inline _Bool sse_min_key_square(__m128i keys, int *square) {
+  const int key = _mm_cvtsi128_si32(_mm_minpos_epu16(keys)) & 0xFFFF;
+
+  if (key == 0xFFFF) {
+    return false;
+  }
+
+  *square = key & 0xFF;
+
+  return true;
+}
+
+__attribute__((target("sse4.1")))
+static _Bool sse_search_target(const uint16_t grid[GRID_SIZE], int *square) {
+  __m128i index = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+  __m128i keys = _mm_set1_epi16(-1);
+
+  for (int i = 0; i < GRID_SIZE; i += 8) {
+    keys = _mm_min_epu16(keys, sse_search_keys(_mm_loadu_si128((const __m128i *)(grid + i)), index));
+    index = _mm_add_epi16(index, _mm_set1_epi16(8));
+  }
+
+  return sse_min_key_square(keys, square);
+}
+
+__attribute__((target("avx2")))
+static _Bool avx2_search_target(const uint16_t grid[GRID_SIZE], int *square) {
+  const __m256i nibble_counts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+						 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  __m256i index = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m256i keys = _mm256_set1_epi16(-1);
+
+  for (int i = 0; i < GRID_SIZE; i += 16) {
+    const __m256i values = _mm256_loadu_si256((const __m256i *)(grid + i));
+
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(values, nibble)),
+				     _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(_mm256_srli_epi16(values, 4), nibble)));
+    counts = _mm256_add_epi16(_mm256_and_si256(counts, _mm256_set1_epi16(0xFF)), _mm256_srli_epi16(counts, 8));
+
+    const __m256i open = _mm256_cmpgt_epi16(counts, _mm256_set1_epi16(1));
+    const __m256i square_keys = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(counts, 8), index),
+						_mm256_andnot_si256(open, _mm256_set1_epi16(-1)));
+
+    keys = _mm256_min_epu16(keys, square_keys);
+    index = _mm256_add_epi16(index, _mm256_set1_epi16(16));
+  }
+
+  return sse_min_key_square(_mm_min_epu16(_mm256_castsi256_si128(keys), _mm256_extracti128_si256(keys, 1)), square);
+}
+
+#endif
+
+// Picked once by select_search_target according to what the CPU supports.
+static _Bool (*search_target)(const uint16_t grid[GRID_SIZE], int *square) = scalar_search_target;
+
+static void select_search_target() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    search_target = avx2_search_target;
+  }
+  else if (__builtin_cpu_supports("sse4.1")) {
+    search_target = sse_search_target;
+  }
+#endif
+}
+
+static inline void copy_grid(const uint16_t src[81], uint16_t dest[81]) {
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    dest[i] = src[i];
+  }
+}
+
+// SplitMix64.
+static inline uint64_t next_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+  return z ^ (z >> 31);
+}
+
+// One of the values, chosen at random.
+static inline uint16_t random_value(uint64_t *state, uint16_t values) {
+  for (int skip = (int)(next_random(state) % (uint64_t)__builtin_popcount(values)); skip > 0; --skip) {
+    values &= values - 1;
+  }
+
+  return values & -values;
+}
+
+/*
+
+  Value Order
+
+  The order in which search tries the values of the square it branches on.
+  ascending is plain bit order. least-constraining tries first the value
+  the fewest open peers still hold, so a guess takes away the fewest
+  options, and most-constraining the value the most hold, so a wrong guess
+  fails soonest. frequency tries first the value with the most places left
+  in the grid.
+
+ */
+
+enum value_order { ORDER_ASCENDING, ORDER_LEAST_CONSTRAINING, ORDER_MOST_CONSTRAINING, ORDER_FREQUENCY };
+
+static const char *const VALUE_ORDER_NAMES[] = { "ascending", "least-constraining", "most-constraining", "frequency" };
+
+#define VALUE_ORDER_COUNT ((int)(sizeof(VALUE_ORDER_NAMES) / sizeof(VALUE_ORDER_NAMES[0])))
+
+// Set before solving starts, by --value-order.
+static enum value_order value_order = ORDER_ASCENDING;
+
+// The value of values to try next at square, lowest first on ties.
+static uint16_t next_value(const struct solver *solver, int square, uint16_t values) {
+  if (value_order == ORDER_ASCENDING || (values & (values - 1)) == 0) {
+    return values & -values;
+  }
+
+  const uint16_t *grid = solver->grid;
+  const _Bool peers_only = value_order != ORDER_FREQUENCY;
+  const int count = peers_only ? NUMBER_OF_PEERS : NUMBER_OF_SQUARES;
+  int counts[9] = {0};
+
+  for (int i = 0; i < count; ++i) {
+    const uint16_t other = grid[peers_only ? PEERS[square][i] : i];
+
+    if ((other & (other - 1)) == 0) {
+      continue;
+    }
+
+    for (uint16_t shared = other & values; shared != 0; shared &= shared - 1) {
+      ++counts[__builtin_ctz(shared)];
+    }
+  }
+
+  int best = __builtin_ctz(values);
+
+  for (uint16_t rest = values & (values - 1); rest != 0; rest &= rest - 1) {
+    const int value = __builtin_ctz(rest);
+
+    if (value_order == ORDER_LEAST_CONSTRAINING ? counts[value] < counts[best] : counts[value] > counts[best]) {
+      best = value;
+    }
+  }
+
+  return (uint16_t)(1 << best);
+}
+
+static inline _Bool branch_target(const struct solver *solver, int *square) {
+  return solver->buckets_kept ? bucket_target(solver, square) : search_target(solver->grid, square);
+}
+
+static inline void push_frame(struct solver *solver, int depth, int square) {
+  struct search_frame *frame = &solver->stack[depth];
+
+  frame->square = (uint8_t)square;
+  frame->values_left = (uint16_t)solver->grid[square];
+  frame->mark = (uint16_t)solver->trail_size;
+}
+
+// Depth first search over an explicit stack of frames, one per guessed
+// square. Each frame remembers the trail size from before its guesses, and
+// trying the next value starts by undoing back to it. Keeps going after a
+// solution until limit solutions are found, which leaves the last one in
+// the solver's grid. Returns the number of solutions found.
+static int search_solutions(struct solver *solver, int limit, const atomic_bool *cancelled) {
+  int square = 0;
+
+  STATS_ADD(nodes, 1);
+
+  if (!branch_target(solver, &square)) {
+    return 1;
+  }
+
+  push_frame(solver, 0, square);
+  int depth = 1;
+  int found = 0;
+
+  while (depth > 0) {
+    if (cancelled != NULL && atomic_load_explicit(cancelled, memory_order_relaxed)) {
+      return found;
+    }
+
+    struct search_frame *frame = &solver->stack[depth - 1];
+    undo(solver, frame->mark);
+
+    if (frame->values_left == 0) {
+      --depth;
+      continue;
+    }
+
+    if (solver->guesses_left == 0) {
+      return found;
+    }
+
+    --solver->guesses_left;
+
+    if (solver->budget != NULL && !spend_node(solver->budget)) {
+      return found;
+    }
+
+    const uint16_t value = solver->random != NULL ?
+      random_value(solver->random, frame->values_left) : next_value(solver, frame->square, frame->values_left);
+    frame->values_left &= ~value;
+
+    STATS_ADD(guesses, 1);
+
+    if (!assign(solver, frame->square, value)) {
+      STATS_ADD(backtracks, 1);
+      continue;
+    }
+
+    STATS_ADD(nodes, 1);
+    STATS_MAX(max_depth, depth);
+
+    if (!branch_target(solver, &square)) {
+      if (++found == limit) {
+	return found;
+      }
+
+      continue;
+    }
+
+    push_frame(solver, depth++, square);
+  }
+
+  return found;
+}
+
+static _Bool search(struct solver *solver, const atomic_bool *cancelled) {
+  return search_solutions(solver, 1, cancelled) == 1;
+}
+
+static _Bool assign_puzzle(const char puzzle[82], struct solver *solver) {
+  uint_fast8_t queue[NUMBER_OF_SQUARES];
+  int queued = 0;
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const char value = puzzle[i];
+    
+    if (value == '.' || value == '0') {
+      continue;
+    }
+    
+    if (value >= '1' && value <= '9') {
+      // Clues are propagated together once they are all in.
+      set_values(solver, i, 1 << (value - 49));
+      queue[queued++] = (uint_fast8_t)i;
+    }
+    else {
+      return false;
+    }
+  }
+
+  STATS_ADD(assigns, queued);
+
+  return propagate(solver, queue, queued) && deduce(solver);
+}
+
+static _Bool solve(const char puzzle[82], uint16_t grid[81]) {
+  STATS_RESET();
+
+  struct solver solver;
+  init_solver(&solver, grid);
+  solver.budget = &solve_budget;
+
+  _Bool solved = assign_puzzle(puzzle, &solver);
+
+  if (solved) {
+    const int root = solver.trail_size;
+
+    solved = search(&solver, NULL);
+
+    if (!solved && solver.budget->exhausted) {
+      undo(&solver, root);
+    }
+  }
+
+  copy_grid(solver.grid, grid);
+
+  return solved;
+}
+
+// Counts the solutions of puzzle, stopping at limit, which must be at least
+// one. A limit of two is enough to tell whether a puzzle is well formed.
+// Returns 0 if the puzzle is invalid or has no solution.
+static int count_solutions(const char puzzle[82], int limit) {
+  STATS_RESET();
+
+  uint16_t grid[81] = {0};
+  default_grid_values(grid);
+
+  struct solver solver;
+  init_solver(&solver, grid);
+
+  if (!assign_puzzle(puzzle, &solver)) {
+    return 0;
+  }
+
+  return search_solutions(&solver, limit, NULL);
+}
+
+/*
+
+  Other Sizes
+
+  Puzzles of 4×4, 16×16 and 25×25 squares are solved by sudoku_nxn.h,
+  instantiated for each box size. The 9×9 instantiation is the generic
+  engine, which is there to check the template against the engines above.
+
+ */
+
+// Symbols of the values, for every size.
+static const char SYMBOLS[] = "123456789ABCDEFGHIJKLMNOP";
+
+// The value a symbol stands for, or -1 if it is not one.
+static inline int symbol_value(char symbol) {
+  if (symbol >= '1' && symbol <= '9') {
+    return symbol - '1';
+  }
+
+  if (symbol >= 'A' && symbol <= 'P') {
+    return symbol - 'A' + 9;
+  }
+
+  if (symbol >= 'a' && symbol <= 'p') {
+    return symbol - 'a' + 9;
+  }
+
+  return -1;
+}
+
+#define BOX 2
+#include "sudoku_nxn.h"
+
+#define BOX 3
+#include "sudoku_nxn.h"
+
+#define BOX 4
+#include "sudoku_nxn.h"
+
+#define BOX 5
+#include "sudoku_nxn.h"
+
+#define MAX_SQUARES 625
+
+struct puzzle_size {
+  int squares;
+  _Bool (*solve_line)(const char *puzzle, char *solution);
+  int (*count_solutions)(const char *puzzle, int limit);
+};
+
+static const struct puzzle_size PUZZLE_SIZES[] =
+  {
+   { 16, box2_solve_line, box2_count_solutions },
+   { 256, box4_solve_line, box4_count_solutions },
+   { 625, box5_solve_line, box5_count_solutions },
+  };
+
+static const int PUZZLE_SIZE_COUNT = sizeof(PUZZLE_SIZES) / sizeof(PUZZLE_SIZES[0]);
+
+// The size with the given number of squares other than 9×9, or NULL.
+static const struct puzzle_size *find_puzzle_size(size_t squares) {
+  for (int i = 0; i < PUZZLE_SIZE_COUNT; ++i) {
+    if ((size_t)PUZZLE_SIZES[i].squares == squares) {
+      return &PUZZLE_SIZES[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+
+  Bitboards
+
+  An alternative representation with one 81 bit board per value, where bit
+  i is set while square i may still hold the value. Solving a square clears
+  its peers from the value's board and the square from every other board,
+  so eliminations happen a whole board at a time instead of peer by peer.
+
+ */
+
+typedef unsigned __int128 bitboard;
+
+#define ALL_SQUARES (((bitboard)1 << NUMBER_OF_SQUARES) - 1)
+#define SQUARE_BIT(i) ((bitboard)1 << (i))
+#define ROW_BITS(i) ((bitboard)0x1FF << (i) / 9 * 9)
+#define COLUMN_BITS(i) (((bitboard)0x100 << 64 | 0x8040201008040201) << (i) % 9)
+#define BOX_BITS(i) ((bitboard)0x1C0E07 << ((i) / 27 * 27 + (i) % 9 / 3 * 3))
+#define PEER_BITS(i) ((ROW_BITS(i) | COLUMN_BITS(i) | BOX_BITS(i)) & ~SQUARE_BIT(i))
+
+static const bitboard PEER_BOARDS[NUMBER_OF_SQUARES] =
+  {
+   PEER_BITS( 0), PEER_BITS( 1), PEER_BITS( 2), PEER_BITS( 3), PEER_BITS( 4), PEER_BITS( 5), PEER_BITS( 6), PEER_BITS( 7), PEER_BITS( 8),
+   PEER_BITS( 9), PEER_BITS(10), PEER_BITS(11), PEER_BITS(12), PEER_BITS(13), PEER_BITS(14), PEER_BITS(15), PEER_BITS(16), PEER_BITS(17),
+   PEER_BITS(18), PEER_BITS(19), PEER_BITS(20), PEER_BITS(21), PEER_BITS(22), PEER_BITS(23), PEER_BITS(24), PEER_BITS(25), PEER_BITS(26),
+   PEER_BITS(27), PEER_BITS(28), PEER_BITS(29), PEER_BITS(30), PEER_BITS(31), PEER_BITS(32), PEER_BITS(33), PEER_BITS(34), PEER_BITS(35),
+   PEER_BITS(36), PEER_BITS(37), PEER_BITS(38), PEER_BITS(39), PEER_BITS(40), PEER_BITS(41), PEER_BITS(42), PEER_BITS(43), PEER_BITS(44),
+   PEER_BITS(45), PEER_BITS(46), PEER_BITS(47), PEER_BITS(48), PEER_BITS(49), PEER_BITS(50), PEER_BITS(51), PEER_BITS(52), PEER_BITS(53),
+   PEER_BITS(54), PEER_BITS(55), PEER_BITS(56), PEER_BITS(57), PEER_BITS(58), PEER_BITS(59), PEER_BITS(60), PEER_BITS(61), PEER_BITS(62),
+   PEER_BITS(63), PEER_BITS(64), PEER_BITS(65), PEER_BITS(66), PEER_BITS(67), PEER_BITS(68), PEER_BITS(69), PEER_BITS(70), PEER_BITS(71),
+   PEER_BITS(72), PEER_BITS(73), PEER_BITS(74), PEER_BITS(75), PEER_BITS(76), PEER_BITS(77), PEER_BITS(78), PEER_BITS(79), PEER_BITS(80),
+  };
+
+struct bitboard_grid {
+  bitboard values[9];
+  // Squares whose value has been cleared from their peers.
+  bitboard solved;
+};
+
+static inline int first_square(bitboard squares) {
+  const uint64_t low = (uint64_t)squares;
+
+  return low != 0 ? __builtin_ctzll(low) : 64 + __builtin_ctzll((uint64_t)(squares >> 64));
+}
+
+static inline void default_bitboard_values(struct bitboard_grid *grid) {
+  for (int i = 0; i < 9; ++i) {
+    grid->values[i] = ALL_SQUARES;
+  }
+
+  grid->solved = 0;
+}
+
+static inline void bitboard_assign(struct bitboard_grid *grid, int square, int value) {
+  STATS_ADD(assigns, 1);
+
+  for (int i = 0; i < 9; ++i) {
+    if (i != value) {
+      grid->values[i] &= ~SQUARE_BIT(square);
+    }
+  }
+}
+
+// The first square of each row, column and box.
+#define ROW_STARTS COLUMN_BITS(0)
+#define COLUMN_STARTS ROW_BITS(0)
+#define BOX_STARTS ((bitboard)0x49 | (bitboard)0x49 << 27 | (bitboard)0x49 << 54)
+
+static const int BOX_OFFSETS[NUMBER_OF_UNIT_SQUARES] = { 0, 1, 2, 9, 10, 11, 18, 19, 20 };
+
+// Returns the squares of values that are the only place for the value in
+// their row, column or box, or ALL_SQUARES if some unit has no place left.
+// Each kind of unit is folded onto its first squares, counting once and
+// twice for all nine units in parallel; the units with exactly one place are
+// then spread back over their squares by multiplying by the unit's shape.
+static bitboard unit_singles(bitboard values) {
+  bitboard row_once = 0, row_twice = 0;
+  bitboard column_once = 0, column_twice = 0;
+  bitboard box_once = 0, box_twice = 0;
+
+#pragma GCC unroll 9
+  for (int i = 0; i < NUMBER_OF_UNIT_SQUARES; ++i) {
+    const bitboard row = values >> i & ROW_STARTS;
+    const bitboard column = values >> (i * 9) & COLUMN_STARTS;
+    const bitboard box = values >> BOX_OFFSETS[i] & BOX_STARTS;
+
+    row_twice |= row_once & row;
+    row_once |= row;
+    column_twice |= column_once & column;
+    column_once |= column;
+    box_twice |= box_once & box;
+    box_once |= box;
+  }
+
+  if (row_once != ROW_STARTS || column_once != COLUMN_STARTS || box_once != BOX_STARTS) {
+    return ALL_SQUARES;
+  }
+
+  const bitboard single_rows = (row_once & ~row_twice) * 0x1FF;
+  const bitboard single_columns = (column_once & ~column_twice) * COLUMN_BITS(0);
+  const bitboard single_boxes = (box_once & ~box_twice) * 0x1C0E07;
+
+  return values & (single_rows | single_columns | single_boxes);
+}
+
+// Clears the values of newly solved squares from their peers, then places
+// hidden singles, until neither finds anything new. Fails when a square has
+// no values left or a unit has no place left for a value.
+static _Bool bitboard_propagate(struct bitboard_grid *grid) {
+  // Boards as of their last hidden single check; an unchanged board has no
+  // new hidden singles. No real board has bits beyond ALL_SQUARES.
+  bitboard checked[9];
+
+  for (int i = 0; i < 9; ++i) {
+    checked[i] = ~(bitboard)0;
+  }
+
+  for (;;) {
+    bitboard once = 0;
+    bitboard twice = 0;
+
+    for (int i = 0; i < 9; ++i) {
+      twice |= once & grid->values[i];
+      once |= grid->values[i];
+    }
+
+    if (once != ALL_SQUARES) {
+      return false;
+    }
+
+    const bitboard singles = once & ~twice & ~grid->solved;
+
+    if (singles != 0) {
+      grid->solved |= singles;
+
+      for (int i = 0; i < 9; ++i) {
+	bitboard solved = grid->values[i] & singles;
+	bitboard peers = 0;
+
+	while (solved != 0) {
+	  peers |= PEER_BOARDS[first_square(solved)];
+	  solved &= solved - 1;
+	  STATS_ADD(propagations, 1);
+	  STATS_ADD(peer_scans, NUMBER_OF_PEERS);
+	}
+
+	grid->values[i] &= ~peers;
+      }
+
+      continue;
+    }
+
+    bitboard hidden[9];
+    bitboard any_hidden = 0;
+
+    for (int i = 0; i < 9; ++i) {
+      if (grid->values[i] == checked[i]) {
+	hidden[i] = 0;
+	continue;
+      }
+
+      checked[i] = grid->values[i];
+      hidden[i] = unit_singles(grid->values[i]);
+
+      if (hidden[i] == ALL_SQUARES) {
+	return false;
+      }
+
+      hidden[i] &= ~grid->solved;
+      any_hidden |= hidden[i];
+    }
+
+    if (any_hidden == 0) {
+      return true;
+    }
+
+    STATS_ADD(hidden_singles, __builtin_popcountll((uint64_t)any_hidden) + __builtin_popcountll((uint64_t)(any_hidden >> 64)));
+
+    for (int i = 0; i < 9; ++i) {
+      for (int j = 0; j < 9; ++j) {
+	if (j != i) {
+	  grid->values[j] &= ~hidden[i];
+	}
+      }
+    }
+  }
+}
+
+// Finds the first square with the fewest values left, like search_target,
+// using a bit sliced count of each square's values.
+static _Bool bitboard_search_target(const struct bitboard_grid *grid, int *square) {
+  bitboard counts[4] = {0};
+
+  for (int i = 0; i < 9; ++i) {
+    bitboard carry = grid->values[i];
+
+    for (int bit = 0; bit < 4 && carry != 0; ++bit) {
+      const bitboard next_carry = counts[bit] & carry;
+      counts[bit] ^= carry;
+      carry = next_carry;
+    }
+  }
+
+  for (int remaining = 2; remaining <= 9; ++remaining) {
+    bitboard squares = ALL_SQUARES;
+
+    for (int bit = 0; bit < 4; ++bit) {
+      squares &= (remaining >> bit & 1) ? counts[bit] : ~counts[bit];
+    }
+
+    if (squares != 0) {
+      *square = first_square(squares);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static _Bool bitboard_search(struct bitboard_grid *grid, int depth) {
+  int square = 0;
+
+  STATS_ADD(nodes, 1);
+  STATS_MAX(max_depth, depth);
+
+  if (!bitboard_search_target(grid, &square)) {
+    return true;
+  }
+
+  for (int i = 0; i < 9; ++i) {
+    if ((grid->values[i] & SQUARE_BIT(square)) == 0) {
+      continue;
+    }
+
+    struct bitboard_grid new_grid = *grid;
+    bitboard_assign(&new_grid, square, i);
+    STATS_ADD(guesses, 1);
+
+    if (!bitboard_propagate(&new_grid)) {
+      STATS_ADD(backtracks, 1);
+      continue;
+    }
+
+    if (bitboard_search(&new_grid, depth + 1)) {
+      *grid = new_grid;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static _Bool bitboard_solve(const char puzzle[82], uint16_t grid[81]) {
+  STATS_RESET();
+
+  struct bitboard_grid bitboards;
+  default_bitboard_values(&bitboards);
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const char value = puzzle[i];
+
+    if (value == '.' || value == '0') {
+      continue;
+    }
+
+    if (value >= '1' && value <= '9') {
+      bitboard_assign(&bitboards, i, value - 49);
+    }
+    else {
+      return false;
+    }
+  }
+
+  const _Bool solved = bitboard_propagate(&bitboards) && bitboard_search(&bitboards, 0);
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    grid[i] = 0;
+
+    for (int j = 0; j < 9; ++j) {
+      grid[i] |= (uint16_t)(bitboards.values[j] >> i & 1) << j;
+    }
+  }
+
+  return solved;
+}
+
+/*
+
+  Dancing Links
+
+  Knuth's Algorithm X over the exact cover matrix of the puzzle: one row
+  per square and value still possible, and one column for each square, and
+  for each value in each row, column and box. The links live in a fixed
+  arena inside struct dlx, so a solve never allocates. Squares with a
+  single value are not placed up front but are chosen first, since their
+  square's column has only one row.
+
+  The auto engine, the default, routes each puzzle between norvig and DLX.
+
+ */
+
+#define DLX_COLUMNS (4 * NUMBER_OF_SQUARES)
+#define DLX_ROWS (9 * NUMBER_OF_SQUARES)
+// The root, the column headers, and four nodes per row.
+#define DLX_NODES (1 + DLX_COLUMNS + 4 * DLX_ROWS)
+
+struct dlx_node {
+  int16_t left;
+  int16_t right;
+  int16_t up;
+  int16_t down;
+  int16_t column;
+  // Square * 9 + value, for nodes in rows.
+  int16_t row;
+};
+
+struct dlx {
+  struct dlx_node nodes[DLX_NODES];
+  int16_t sizes[1 + DLX_COLUMNS];
+  int16_t solution[NUMBER_OF_SQUARES];
+  struct solve_budget *budget;
+};
+
+// Builds the matrix with a row for each value left in grid. Node 0 is the
+// root, and nodes 1 to DLX_COLUMNS head the columns.
+static void dlx_init(struct dlx *dlx, const uint16_t grid[81]) {
+  struct dlx_node *nodes = dlx->nodes;
+
+  for (int i = 0; i <= DLX_COLUMNS; ++i) {
+    nodes[i] = (struct dlx_node){
+      .left = (int16_t)(i == 0 ? DLX_COLUMNS : i - 1),
+      .right = (int16_t)(i == DLX_COLUMNS ? 0 : i + 1),
+      .up = (int16_t)i,
+      .down = (int16_t)i,
+      .column = (int16_t)i,
+      .row = -1,
+    };
+    dlx->sizes[i] = 0;
+  }
+
+  int next = 1 + DLX_COLUMNS;
+
+  for (int square = 0; square < NUMBER_OF_SQUARES; ++square) {
+    const int row = square / 9;
+    const int column = square % 9;
+    const int box = row / 3 * 3 + column / 3;
+
+    for (uint16_t values = grid[square]; values != 0; values &= values - 1) {
+      const int value = __builtin_ctz(values);
+      const int columns[4] =
+	{
+	 1 + square,
+	 1 + NUMBER_OF_SQUARES + row * 9 + value,
+	 1 + 2 * NUMBER_OF_SQUARES + column * 9 + value,
+	 1 + 3 * NUMBER_OF_SQUARES + box * 9 + value,
+	};
+
+      for (int i = 0; i < 4; ++i) {
+	const int node = next + i;
+	const int header = columns[i];
+
+	nodes[node] = (struct dlx_node){
+	  .left = (int16_t)(next + (i + 3) % 4),
+	  .right = (int16_t)(next + (i + 1) % 4),
+	  .up = nodes[header].up,
+	  .down = (int16_t)header,
+	  .column = (int16_t)header,
+	  .row = (int16_t)(square * 9 + value),
+	};
+	nodes[nodes[header].up].down = (int16_t)node;
+	nodes[header].up = (int16_t)node;
+	++dlx->sizes[header];
+      }
+
+      next += 4;
+    }
+  }
+}
+
+static inline void dlx_cover(struct dlx *dlx, int column) {
+  struct dlx_node *nodes = dlx->nodes;
+
+  nodes[nodes[column].right].left = nodes[column].left;
+  nodes[nodes[column].left].right = nodes[column].right;
+
+  for (int i = nodes[column].down; i != column; i = nodes[i].down) {
+    for (int j = nodes[i].right; j != i; j = nodes[j].right) {
+      nodes[nodes[j].down].up = nodes[j].up;
+      nodes[nodes[j].up].down = nodes[j].down;
+      --dlx->sizes[nodes[j].column];
+    }
+  }
+}
+
+static inline void dlx_uncover(struct dlx *dlx, int column) {
+  struct dlx_node *nodes = dlx->nodes;
+
+  for (int i = nodes[column].up; i != column; i = nodes[i].up) {
+    for (int j = nodes[i].left; j != i; j = nodes[j].left) {
+      ++dlx->sizes[nodes[j].column];
+      nodes[nodes[j].down].up = (int16_t)j;
+      nodes[nodes[j].up].down = (int16_t)j;
+    }
+  }
+
+  nodes[nodes[column].right].left = (int16_t)column;
+  nodes[nodes[column].left].right = (int16_t)column;
+}
+
+// Covers the column with the fewest rows and tries each of them in turn.
+// A column with one row is a forced move and does not count as a guess.
+static _Bool dlx_search(struct dlx *dlx, int depth) {
+  const struct dlx_node *nodes = dlx->nodes;
+
+  STATS_ADD(nodes, 1);
+  STATS_MAX(max_depth, depth);
+
+  if (nodes[0].right == 0) {
+    return true;
+  }
+
+  int column = nodes[0].right;
+
+  for (int i = nodes[column].right; i != 0 && dlx->sizes[column] > 1; i = nodes[i].right) {
+    if (dlx->sizes[i] < dlx->sizes[column]) {
+      column = i;
+    }
+  }
+
+  if (dlx->sizes[column] == 0) {
+    return false;
+  }
+
+  const _Bool forced = dlx->sizes[column] == 1;
+
+  dlx_cover(dlx, column);
+
+  for (int i = nodes[column].down; i != column; i = nodes[i].down) {
+    if (!forced) {
+      // Every level below stops the same way, uncovering what it covered.
+      if (!spend_node(dlx->budget)) {
+	break;
+      }
+
+      STATS_ADD(guesses, 1);
+    }
+
+    dlx->solution[depth] = nodes[i].row;
+
+    for (int j = nodes[i].right; j != i; j = nodes[j].right) {
+      dlx_cover(dlx, nodes[j].column);
+    }
+
+    if (dlx_search(dlx, depth + 1)) {
+      return true;
+    }
+
+    for (int j = nodes[i].left; j != i; j = nodes[j].left) {
+      dlx_uncover(dlx, nodes[j].column);
+    }
+
+    if (!forced) {
+      STATS_ADD(backtracks, 1);
+    }
+  }
+
+  dlx_uncover(dlx, column);
+
+  return false;
+}
+
+// Solves the puzzle left in grid, which may already be narrowed down by
+// propagation, and puts the solution in grid. Leaves grid as it was when
+// there is none or the budget runs out.
+static _Bool dlx_solve_grid(uint16_t grid[81]) {
+  struct dlx dlx;
+  dlx_init(&dlx, grid);
+  dlx.budget = &solve_budget;
+
+  if (!dlx_search(&dlx, 0)) {
+    return false;
+  }
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    grid[dlx.solution[i] / 9] = (uint16_t)(1 << dlx.solution[i] % 9);
+  }
+
+  return true;
+}
+
+static _Bool dlx_solve(const char puzzle[82], uint16_t grid[81]) {
+  STATS_RESET();
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const char value = puzzle[i];
+
+    if (value == '.' || value == '0') {
+      continue;
+    }
+
+    if (value >= '1' && value <= '9') {
+      grid[i] = (uint16_t)(1 << (value - 49));
+    }
+    else {
+      return false;
+    }
+  }
+
+  return dlx_solve_grid(grid);
+}
+
+// The norvig search needs fewer than 450 guesses for every bundled puzzle,
+// but a few rare puzzles send it down trees of hundreds of thousands of
+// nodes that DLX, which also branches on the places left for a value,
+// gets through in microseconds.
+#define AUTO_GUESS_BUDGET 1024
+
+// Solves with the norvig engine, handing the puzzle to DLX from the
+// propagated clues if the search runs out of guesses.
+static _Bool auto_solve(const char puzzle[82], uint16_t grid[81]) {
+  STATS_RESET();
+
+  struct solver solver;
+  init_solver(&solver, grid);
+  solver.budget = &solve_budget;
+
+  _Bool solved = assign_puzzle(puzzle, &solver);
+
+  if (solved) {
+    const int root = solver.trail_size;
+
+    solver.guesses_left = AUTO_GUESS_BUDGET;
+    solved = search(&solver, NULL);
+
+    if (!solved && (solver.guesses_left == 0 || solver.budget->exhausted)) {
+      undo(&solver, root);
+      solved = !solver.budget->exhausted && dlx_solve_grid(solver.grid);
+    }
+  }
+
+  copy_grid(solver.grid, grid);
+
+  return solved;
+}
+
+/*
+
+  Lockstep
+
+  Easy puzzles are solved by propagation alone, so for batches of them the
+  time goes to the same few steps over and over. The lockstep kernel holds
+  LOCKSTEP_LANES puzzles structure of arrays, one 256 bit vector per square
+  with a 16 bit lane per puzzle, and applies both of Norvig's rules to all
+  of them at once in rounds: a round first sums up each unit's solved and
+  hidden values, then clears the solved ones from every square's peers and
+  places the hidden ones, until a round changes nothing. Lanes left with an
+  open square or a contradiction are not solved by the kernel, and callers
+  hand them to a scalar engine. A lane it does solve has the one solution
+  its puzzle can have, since every value placed was forced.
+
+  The kernel needs AVX2. Elsewhere lockstep_solve stays NULL and every
+  puzzle takes the scalar path.
+
+ */
+
+#define LOCKSTEP_LANES 16
+
+// Propagates count puzzles of 81 squares in lockstep, returning a mask of
+// the lanes solved, with their solutions in grids.
+static unsigned (*lockstep_solve)(const char *const puzzles[LOCKSTEP_LANES], int count,
+				  uint16_t grids[LOCKSTEP_LANES][81]) = NULL;
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Invalid symbols get no values, which the kernel takes as a contradiction.
+static const uint16_t LOCKSTEP_SYMBOL_VALUES[256] =
+  {
+   ['.'] = 0x1FF, ['0'] = 0x1FF,
+   ['1'] = 1 << 0, ['2'] = 1 << 1, ['3'] = 1 << 2, ['4'] = 1 << 3, ['5'] = 1 << 4,
+   ['6'] = 1 << 5, ['7'] = 1 << 6, ['8'] = 1 << 7, ['9'] = 1 << 8,
+  };
+
+__attribute__((target("avx2")))
+static unsigned avx2_lockstep_solve(const char *const puzzles[LOCKSTEP_LANES], int count,
+				    uint16_t grids[LOCKSTEP_LANES][81]) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(-1);
+  const __m256i all_values = _mm256_set1_epi16(0x1FF);
+  const __m256i one = _mm256_set1_epi16(1);
+  __m256i cells[NUMBER_OF_SQUARES];
+  _Alignas(32) uint16_t lanes[LOCKSTEP_LANES];
+
+  // Unused lanes hold an empty grid, which no round changes.
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+      lanes[lane] = lane < count ? LOCKSTEP_SYMBOL_VALUES[(uint8_t)puzzles[lane][i]] : 0x1FF;
+    }
+
+    cells[i] = _mm256_load_si256((const __m256i *)lanes);
+  }
+
+  // All ones in the lanes with a contradiction or an open square.
+  __m256i failed = zero;
+  __m256i open;
+
+  for (;;) {
+    __m256i changed = zero;
+
+    open = zero;
+
+    for (int unit = 0; unit < NUMBER_OF_UNITS; ++unit) {
+      __m256i singles[NUMBER_OF_UNIT_SQUARES];
+      __m256i solved_once = zero;
+      __m256i solved_twice = zero;
+      __m256i once = zero;
+      __m256i twice = zero;
+
+      for (int i = 0; i < NUMBER_OF_UNIT_SQUARES; ++i) {
+	const __m256i values = cells[UNITS[unit][i]];
+	const __m256i single = _mm256_cmpeq_epi16(_mm256_and_si256(values, _mm256_sub_epi16(values, one)), zero);
+
+	singles[i] = _mm256_and_si256(values, single);
+	open = _mm256_or_si256(open, _mm256_andnot_si256(single, ones));
+	failed = _mm256_or_si256(failed, _mm256_cmpeq_epi16(values, zero));
+	solved_twice = _mm256_or_si256(solved_twice, _mm256_and_si256(solved_once, singles[i]));
+	solved_once = _mm256_or_si256(solved_once, singles[i]);
+	twice = _mm256_or_si256(twice, _mm256_and_si256(once, values));
+	once = _mm256_or_si256(once, values);
+      }
+
+      // A value solved twice, or with no place left.
+      failed = _mm256_or_si256(failed, _mm256_andnot_si256(_mm256_cmpeq_epi16(solved_twice, zero), ones));
+      failed = _mm256_or_si256(failed, _mm256_andnot_si256(_mm256_cmpeq_epi16(once, all_values), ones));
+
+      const __m256i hidden = _mm256_andnot_si256(twice, once);
+
+      for (int i = 0; i < NUMBER_OF_UNIT_SQUARES; ++i) {
+	__m256i *square = &cells[UNITS[unit][i]];
+	__m256i values = _mm256_andnot_si256(_mm256_andnot_si256(singles[i], solved_once), *square);
+	const __m256i placed = _mm256_and_si256(values, hidden);
+
+	values = _mm256_blendv_epi8(placed, values, _mm256_cmpeq_epi16(placed, zero));
+	changed = _mm256_or_si256(changed, _mm256_xor_si256(values, *square));
+	*square = values;
+      }
+    }
+
+    // Squares only ever lose values, so this ends, and the checks of a
+    // sweep that changed nothing saw the final grids.
+    if (_mm256_testz_si256(changed, changed)) {
+      break;
+    }
+  }
+
+  const unsigned unsolved = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(failed, open));
+  unsigned solved = 0;
+
+  for (int lane = 0; lane < count; ++lane) {
+    if ((unsolved >> 2 * lane & 1) == 0) {
+      solved |= 1u << lane;
+    }
+  }
+
+  for (int i = 0; i < NUMBER_OF_SQUARES && solved != 0; ++i) {
+    _mm256_store_si256((__m256i *)lanes, cells[i]);
+
+    for (int lane = 0; lane < count; ++lane) {
+      grids[lane][i] = lanes[lane];
+    }
+  }
+
+  return solved;
+}
+
+#endif
+
+static void select_lockstep() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    lockstep_solve = avx2_lockstep_solve;
+  }
+#endif
+}
+
+/*
+
+  Engines
+
+ */
+
+struct engine {
+  const char *name;
+  _Bool (*solve)(const char puzzle[82], uint16_t grid[81]);
+  // Batches go through the lockstep kernel first.
+  _Bool lockstep;
+};
+
+static const struct engine ENGINES[] =
+  {
+   { "norvig", solve, false },
+   { "bitboard", bitboard_solve, false },
+   { "generic", box3_solve, false },
+   { "dlx", dlx_solve, false },
+   { "auto", auto_solve, true },
+  };
+
+static const int ENGINE_COUNT = sizeof(ENGINES) / sizeof(ENGINES[0]);
+
+static const struct engine *find_engine(const char *name) {
+  for (int i = 0; i < ENGINE_COUNT; ++i) {
+    if (strcmp(ENGINES[i].name, name) == 0) {
+      return &ENGINES[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+
+  Library
+
+  The functions of sudoku.h. They check the input themselves, and tell
+  invalid input from puzzles without solutions, which the engines do not.
+
+ */
+
+static pthread_once_t library_once = PTHREAD_ONCE_INIT;
+
+static enum sudoku_status check_puzzle(const char *puzzle) {
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    if (puzzle[i] != '.' && (puzzle[i] < '0' || puzzle[i] > '9')) {
+      return SUDOKU_INVALID_INPUT;
+    }
+  }
+
+  return SUDOKU_SOLVED;
+}
+
+enum sudoku_status sudoku_solve_limited(const char *puzzle, char *solution, unsigned long long max_nodes,
+				       double max_seconds) {
+  pthread_once(&library_once, select_search_target);
+
+  enum sudoku_status status = check_puzzle(puzzle);
+  uint16_t grid[81] = {0};
+
+  if (status == SUDOKU_SOLVED) {
+    default_grid_values(grid);
+    start_budget(max_nodes, max_seconds);
+
+    if (!auto_solve(puzzle, grid)) {
+      status = solve_budget.exhausted ? SUDOKU_TIMED_OUT : SUDOKU_NO_SOLUTION;
+    }
+  }
+
+  if (status == SUDOKU_SOLVED || status == SUDOKU_TIMED_OUT) {
+    for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+      solution[i] = (grid[i] & (grid[i] - 1)) == 0 ? (char)('1' + __builtin_ctz(grid[i])) : '.';
+    }
+  }
+  else {
+    memset(solution, '.', NUMBER_OF_SQUARES);
+  }
+
+  return status;
+}
+
+enum sudoku_status sudoku_solve(const char *puzzle, char *solution) {
+  return sudoku_solve_limited(puzzle, solution, 0, 0);
+}
+
+size_t sudoku_solve_batch(const char *puzzles, size_t n, char *out, enum sudoku_status *statuses) {
+  size_t solved = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    const enum sudoku_status status = sudoku_solve(puzzles + i * NUMBER_OF_SQUARES, out + i * NUMBER_OF_SQUARES);
+
+    solved += status == SUDOKU_SOLVED;
+
+    if (statuses != NULL) {
+      statuses[i] = status;
+    }
+  }
+
+  return solved;
+}
+
+int sudoku_count_solutions(const char *puzzle, int limit) {
+  pthread_once(&library_once, select_search_target);
+
+  if (check_puzzle(puzzle) != SUDOKU_SOLVED) {
+    return -1;
+  }
+
+  return limit < 1 ? 0 : count_solutions(puzzle, limit);
+}
+
+const char *sudoku_status_name(enum sudoku_status status) {
+  switch (status) {
+  case SUDOKU_SOLVED:
+    return "solved";
+  case SUDOKU_NO_SOLUTION:
+    return "no solution";
+  case SUDOKU_INVALID_INPUT:
+    return "invalid input";
+  case SUDOKU_TIMED_OUT:
+    return "timed out";
+  }
+
+  return "unknown";
+}
+
+/*
+
+  Canonical Form
+
+  Relabeling digits, permuting bands, rows within a band, stacks or columns
+  within a stack, and transposing all map puzzles to puzzles whose solutions
+  map the same way. canonicalize picks one representative of each class of
+  puzzles related by these transforms, and the transform that reaches it.
+
+  Trying all 2 * 6^8 orders of rows and columns is far too slow, so rows,
+  columns, bands and stacks first get keys from a few rounds of refinement
+  that only depend on the clues, not on where the transform put them. Only
+  orders that sort the keys are tried, and among those images, with digits
+  numbered by first appearance, the smallest wins. Since the keys move with
+  the rows and columns, every puzzle in a class tries the same images.
+
+ */
+
+#define REFINEMENT_ROUNDS 2
+
+// Puzzles that still allow more orders than this after refinement, such as
+// nearly empty ones, are not canonicalized.
+#define MAX_CANONICAL_ORDERS 256
+
+static const uint8_t PERMUTATIONS_OF_3[6][3] =
+  {
+   { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 },
+  };
+
+// Image square (r, c) holds digits[d], where d is at (rows[r], columns[c])
+// of the puzzle, transposed first if transpose is set.
+struct transform {
+  _Bool transpose;
+  uint8_t rows[9];
+  uint8_t columns[9];
+  uint8_t digits[10];
+};
+
+static inline uint64_t mix_key(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xFF51AFD7ED558CCDULL;
+  key ^= key >> 33;
+  key *= 0xC4CEB9FE1A85EC53ULL;
+  key ^= key >> 33;
+
+  return key;
+}
+
+// Keys for the rows and columns of cells, built from sums so that they do
+// not depend on the order of anything.
+static void refine_keys(const uint8_t cells[81], uint64_t rows[9], uint64_t columns[9]) {
+  uint64_t digits[10] = {0};
+
+  for (int i = 0; i < 9; ++i) {
+    rows[i] = columns[i] = 0;
+  }
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    if (cells[i] != 0) {
+      ++rows[i / 9];
+      ++columns[i % 9];
+      ++digits[cells[i]];
+    }
+  }
+
+  for (int round = 0; round < REFINEMENT_ROUNDS; ++round) {
+    uint64_t bands[3] = {0};
+    uint64_t stacks[3] = {0};
+    uint64_t new_rows[9];
+    uint64_t new_columns[9];
+    uint64_t new_digits[10];
+
+    for (int i = 0; i < 9; ++i) {
+      bands[i / 3] += mix_key(rows[i]);
+      stacks[i / 3] += mix_key(columns[i]);
+    }
+
+    for (int i = 0; i < 10; ++i) {
+      new_digits[i] = digits[i];
+    }
+
+    for (int i = 0; i < 9; ++i) {
+      new_rows[i] = rows[i] + mix_key(bands[i / 3] ^ 0x1);
+      new_columns[i] = columns[i] + mix_key(stacks[i / 3] ^ 0x1);
+    }
+
+    for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+      const int digit = cells[i];
+
+      if (digit == 0) {
+	continue;
+      }
+
+      const int row = i / 9;
+      const int column = i % 9;
+
+      new_rows[row] += mix_key(columns[column] ^ mix_key(digits[digit] + stacks[column / 3]));
+      new_columns[column] += mix_key(rows[row] ^ mix_key(digits[digit] + bands[row / 3]));
+      new_digits[digit] += mix_key(rows[row] + columns[column]);
+    }
+
+    for (int i = 0; i < 9; ++i) {
+      rows[i] = mix_key(new_rows[i]);
+      columns[i] = mix_key(new_columns[i]);
+    }
+
+    for (int i = 0; i < 10; ++i) {
+      digits[i] = mix_key(new_digits[i]);
+    }
+  }
+}
+
+// Fills orders with every order of the nine lines that sorts the keys of
+// their bands, and then the keys of the lines within each band. Returns the
+// number of orders, or -1 if there are more than max.
+static int sorted_orders(const uint64_t keys[9], uint8_t (*orders)[9], int max) {
+  uint64_t bands[3] = {0};
+
+  for (int i = 0; i < 9; ++i) {
+    bands[i / 3] += mix_key(keys[i]);
+  }
+
+  // The orders of the lines within each band that sort their keys.
+  int line_orders[3][6];
+  int line_order_counts[3] = {0};
+
+  for (int band = 0; band < 3; ++band) {
+    const uint64_t *band_keys = keys + band * 3;
+
+    for (int p = 0; p < 6; ++p) {
+      const uint8_t *order = PERMUTATIONS_OF_3[p];
+
+      if (band_keys[order[0]] <= band_keys[order[1]] && band_keys[order[1]] <= band_keys[order[2]]) {
+	line_orders[band][line_order_counts[band]++] = p;
+      }
+    }
+  }
+
+  int count = 0;
+
+  for (int p = 0; p < 6; ++p) {
+    const uint8_t *band_order = PERMUTATIONS_OF_3[p];
+
+    if (bands[band_order[0]] > bands[band_order[1]] || bands[band_order[1]] > bands[band_order[2]]) {
+      continue;
+    }
+
+    const int *first = line_orders[band_order[0]];
+    const int *second = line_orders[band_order[1]];
+    const int *third = line_orders[band_order[2]];
+
+    for (int i = 0; i < line_order_counts[band_order[0]]; ++i) {
+      for (int j = 0; j < line_order_counts[band_order[1]]; ++j) {
+	for (int k = 0; k < line_order_counts[band_order[2]]; ++k) {
+	  if (count == max) {
+	    return -1;
+	  }
+
+	  const int within[3] = { first[i], second[j], third[k] };
+
+	  for (int slot = 0; slot < 3; ++slot) {
+	    for (int line = 0; line < 3; ++line) {
+	      orders[count][slot * 3 + line] = (uint8_t)(band_order[slot] * 3 + PERMUTATIONS_OF_3[within[slot]][line]);
+	    }
+	  }
+
+	  ++count;
+	}
+      }
+    }
+  }
+
+  return count;
+}
+
+// Puts the canonical form of puzzle in canonical, using '.' for blanks, and
+// the transform from puzzle to it in transform. Fails on invalid characters
+// and on puzzles with too many orders left to try.
+static _Bool canonicalize(const char puzzle[82], char canonical[82], struct transform *transform) {
+  uint8_t cells[2][NUMBER_OF_SQUARES];
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const char value = puzzle[i];
+    uint8_t digit = 0;
+
+    if (value >= '1' && value <= '9') {
+      digit = (uint8_t)(value - '0');
+    }
+    else if (value != '.' && value != '0') {
+      return false;
+    }
+
+    cells[0][i] = digit;
+    cells[1][(i % 9) * 9 + i / 9] = digit;
+  }
+
+  // Refinement treats rows and columns alike, so the keys of the transposed
+  // puzzle are the same keys swapped.
+  uint64_t keys[2][9];
+  refine_keys(cells[0], keys[0], keys[1]);
+
+  uint8_t best[NUMBER_OF_SQUARES];
+  _Bool found = false;
+
+  for (int transpose = 0; transpose < 2; ++transpose) {
+    const uint8_t *source = cells[transpose];
+    const uint64_t *row_keys = keys[transpose];
+    const uint64_t *column_keys = keys[!transpose];
+    uint8_t row_orders[MAX_CANONICAL_ORDERS][9];
+    uint8_t column_orders[MAX_CANONICAL_ORDERS][9];
+
+    const int row_count = sorted_orders(row_keys, row_orders, MAX_CANONICAL_ORDERS);
+    const int column_count = sorted_orders(column_keys, column_orders, MAX_CANONICAL_ORDERS);
+
+    if (row_count < 0 || column_count < 0 || row_count * column_count > MAX_CANONICAL_ORDERS) {
+      return false;
+    }
+
+    for (int r = 0; r < row_count; ++r) {
+      for (int c = 0; c < column_count; ++c) {
+	const uint8_t *rows = row_orders[r];
+	const uint8_t *columns = column_orders[c];
+	uint8_t image[NUMBER_OF_SQUARES];
+	uint8_t labels[10] = {0};
+	uint8_t next_label = 1;
+	_Bool smaller = !found;
+	_Bool larger = false;
+
+	for (int row = 0; row < 9 && !larger; ++row) {
+	  const uint8_t *source_row = source + rows[row] * 9;
+	  uint8_t *image_row = image + row * 9;
+
+	  for (int column = 0; column < 9; ++column) {
+	    const uint8_t digit = source_row[columns[column]];
+
+	    if (digit != 0 && labels[digit] == 0) {
+	      labels[digit] = next_label++;
+	    }
+
+	    image_row[column] = labels[digit];
+	  }
+
+	  if (!smaller) {
+	    const int order = memcmp(image_row, best + row * 9, 9);
+
+	    smaller = order < 0;
+	    larger = order > 0;
+	  }
+	}
+
+	if (!smaller) {
+	  continue;
+	}
+
+	memcpy(best, image, sizeof(best));
+	found = true;
+
+	transform->transpose = transpose;
+	memcpy(transform->rows, rows, sizeof(transform->rows));
+	memcpy(transform->columns, columns, sizeof(transform->columns));
+
+	// Digits missing from the puzzle take the remaining labels in order.
+	for (int digit = 1; digit <= 9; ++digit) {
+	  if (labels[digit] == 0) {
+	    labels[digit] = next_label++;
+	  }
+	}
+
+	memcpy(transform->digits, labels, sizeof(transform->digits));
+      }
+    }
+  }
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    canonical[i] = best[i] != 0 ? (char)('0' + best[i]) : '.';
+  }
+
+  canonical[NUMBER_OF_SQUARES] = '\0';
+
+  return true;
+}
+
+// Maps a solution of the canonical puzzle back to the puzzle it came from.
+static void apply_inverse_transform(const struct transform *transform, const char solution[81], uint16_t grid[81]) {
+  uint8_t digits[10];
+
+  for (int digit = 1; digit <= 9; ++digit) {
+    digits[transform->digits[digit]] = (uint8_t)digit;
+  }
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const int row = transform->rows[i / 9];
+    const int column = transform->columns[i % 9];
+    const int square = transform->transpose ? column * 9 + row : row * 9 + column;
+
+    grid[square] = (uint16_t)(1 << (digits[solution[i] - '0'] - 1));
+  }
+}
+
+// The reverse: writes the solved grid of the puzzle as a solution of its
+// canonical form.
+static void apply_transform(const struct transform *transform, const uint16_t grid[81], char solution[81]) {
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const int row = transform->rows[i / 9];
+    const int column = transform->columns[i % 9];
+    const int square = transform->transpose ? column * 9 + row : row * 9 + column;
+
+    solution[i] = (char)('0' + transform->digits[1 + __builtin_ctz(grid[square])]);
+  }
+}
+
+/*
+
+  Solution Cache
+
+  A bounded hash table from canonical puzzles to the solutions of the
+  canonical puzzles. Each hash picks a set of CACHE_WAYS entries, and a full
+  set replaces its entries in turn. Sets are guarded by a fixed number of
+  striped locks, so batch threads can share one cache.
+
+ */
+
+#define CACHE_WAYS 4
+#define CACHE_LOCKS 64
+#define DEFAULT_CACHE_CAPACITY (1 << 20)
+
+struct cache_entry {
+  uint64_t hash;
+  char puzzle[NUMBER_OF_SQUARES];
+  // All zero for puzzles without a solution.
+  char solution[NUMBER_OF_SQUARES];
+};
+
+struct solution_cache {
+  size_t set_count;
+  struct cache_entry *entries;
+  uint8_t *next_way;
+  pthread_mutex_t locks[CACHE_LOCKS];
+  atomic_ulong hits;
+  atomic_ulong misses;
+};
+
+static uint64_t hash_puzzle(const char puzzle[81]) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    hash = (hash ^ (uint8_t)puzzle[i]) * 0x100000001B3ULL;
+  }
+
+  // Zero marks an empty entry.
+  return hash | 1;
+}
+
+// Creates a cache with room for at least capacity puzzles.
+static struct solution_cache *create_cache(size_t capacity) {
+  size_t set_count = 1;
+
+  while (set_count * CACHE_WAYS < capacity) {
+    set_count *= 2;
+  }
+
+  struct solution_cache *cache = calloc(1, sizeof(*cache));
+
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->set_count = set_count;
+  cache->entries = calloc(set_count * CACHE_WAYS, sizeof(*cache->entries));
+  cache->next_way = calloc(set_count, sizeof(*cache->next_way));
+
+  if (cache->entries == NULL || cache->next_way == NULL) {
+    free(cache->entries);
+    free(cache->next_way);
+    free(cache);
+    return NULL;
+  }
+
+  for (int i = 0; i < CACHE_LOCKS; ++i) {
+    pthread_mutex_init(&cache->locks[i], NULL);
+  }
+
+  atomic_init(&cache->hits, 0);
+  atomic_init(&cache->misses, 0);
+
+  return cache;
+}
+
+static void destroy_cache(struct solution_cache *cache) {
+  for (int i = 0; i < CACHE_LOCKS; ++i) {
+    pthread_mutex_destroy(&cache->locks[i]);
+  }
+
+  free(cache->entries);
+  free(cache->next_way);
+  free(cache);
+}
+
+static _Bool cache_lookup(struct solution_cache *cache, uint64_t hash, const char puzzle[81], char solution[81]) {
+  const size_t set = hash & (cache->set_count - 1);
+  const struct cache_entry *entries = cache->entries + set * CACHE_WAYS;
+  _Bool found = false;
+
+  pthread_mutex_lock(&cache->locks[set % CACHE_LOCKS]);
+
+  for (int way = 0; way < CACHE_WAYS && !found; ++way) {
+    if (entries[way].hash == hash && memcmp(entries[way].puzzle, puzzle, NUMBER_OF_SQUARES) == 0) {
+      memcpy(solution, entries[way].solution, NUMBER_OF_SQUARES);
+      found = true;
+    }
+  }
+
+  pthread_mutex_unlock(&cache->locks[set % CACHE_LOCKS]);
+
+  return found;
+}
+
+static void cache_store(struct solution_cache *cache, uint64_t hash, const char puzzle[81], const char solution[81]) {
+  const size_t set = hash & (cache->set_count - 1);
+  struct cache_entry *entries = cache->entries + set * CACHE_WAYS;
+
+  pthread_mutex_lock(&cache->locks[set % CACHE_LOCKS]);
+
+  int way = 0;
+
+  while (way < CACHE_WAYS && entries[way].hash != 0 &&
+	 (entries[way].hash != hash || memcmp(entries[way].puzzle, puzzle, NUMBER_OF_SQUARES) != 0)) {
+    ++way;
+  }
+
+  if (way == CACHE_WAYS) {
+    way = cache->next_way[set];
+    cache->next_way[set] = (uint8_t)((way + 1) % CACHE_WAYS);
+  }
+
+  entries[way].hash = hash;
+  memcpy(entries[way].puzzle, puzzle, NUMBER_OF_SQUARES);
+  memcpy(entries[way].solution, solution, NUMBER_OF_SQUARES);
+
+  pthread_mutex_unlock(&cache->locks[set % CACHE_LOCKS]);
+}
+
+// Solves puzzle with engine, going through the cache when the puzzle can be
+// canonicalized. For puzzles with several solutions, a cached solution may
+// differ from the one engine would find.
+static _Bool solve_cached(struct solution_cache *cache, const struct engine *engine, const char puzzle[82],
+			  uint16_t grid[81]) {
+  char canonical[NUMBER_OF_SQUARES + 1];
+  struct transform transform;
+
+  if (!canonicalize(puzzle, canonical, &transform)) {
+    return engine->solve(puzzle, grid);
+  }
+
+  const uint64_t hash = hash_puzzle(canonical);
+  char solution[NUMBER_OF_SQUARES];
+
+  if (cache_lookup(cache, hash, canonical, solution)) {
+    atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+
+    if (solution[0] == 0) {
+      return false;
+    }
+
+    apply_inverse_transform(&transform, solution, grid);
+
+    return true;
+  }
+
+  atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+  const _Bool solved = engine->solve(puzzle, grid);
+
+  // A puzzle that ran out of budget may still have a solution.
+  if (!solved && solve_budget.exhausted) {
+    return false;
+  }
+
+  if (solved) {
+    apply_transform(&transform, grid, solution);
+  }
+  else {
+    memset(solution, 0, sizeof(solution));
+  }
+
+  cache_store(cache, hash, canonical, solution);
+
+  return solved;
+}
+
+// Whether puzzle has only clues and '.', and solution is either empty or
+// a full grid that keeps the clues and breaks no rule. Lines of a cache
+// file that fail this are skipped, since lookups trust what they find.
+static _Bool is_cache_entry(const char puzzle[81], const char solution[81]) {
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    if (puzzle[i] != '.' && (puzzle[i] < '1' || puzzle[i] > '9')) {
+      return false;
+    }
+  }
+
+  if (solution[0] == 0) {
+    return true;
+  }
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    if (solution[i] < '1' || solution[i] > '9' || (puzzle[i] != '.' && puzzle[i] != solution[i])) {
+      return false;
+    }
+
+    for (int j = 0; j < NUMBER_OF_PEERS; ++j) {
+      if (solution[PEERS[i][j]] == solution[i]) {
+	return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Cache files hold one canonical puzzle and its solution per line, or a
+// puzzle alone if it has no solution.
+static void read_cache(struct solution_cache *cache, FILE *file) {
+  char line[2 * NUMBER_OF_SQUARES + 3];
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    const size_t length = strcspn(line, "\r\n");
+    char solution[NUMBER_OF_SQUARES] = {0};
+
+    if (length == 2 * NUMBER_OF_SQUARES + 1 && line[NUMBER_OF_SQUARES] == ' ') {
+      memcpy(solution, line + NUMBER_OF_SQUARES + 1, NUMBER_OF_SQUARES);
+    }
+    else if (length != NUMBER_OF_SQUARES) {
+      continue;
+    }
+
+    if (!is_cache_entry(line, solution)) {
+      continue;
+    }
+
+    cache_store(cache, hash_puzzle(line), line, solution);
+  }
+}
+
+static void write_cache(const struct solution_cache *cache, FILE *file);
+
+// Creates a cache for capacity puzzles, filled from the cache file at path
+// if there is one.
+static struct solution_cache *load_cache(size_t capacity, const char *path) {
+  struct solution_cache *cache = create_cache(capacity);
+
+  if (cache == NULL || path == NULL) {
+    return cache;
+  }
+
+  FILE *file = fopen(path, "r");
+
+  if (file != NULL) {
+    read_cache(cache, file);
+    fclose(file);
+  }
+  else if (errno != ENOENT) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+  }
+
+  return cache;
+}
+
+// Writes the cache to path unless it is NULL, reports the hits and misses on
+// stderr, and destroys the cache.
+static _Bool save_cache(struct solution_cache *cache, const char *path) {
+  _Bool saved = true;
+
+  if (path != NULL) {
+    FILE *file = fopen(path, "w");
+
+    if (file != NULL) {
+      write_cache(cache, file);
+      saved = fclose(file) == 0;
+    }
+    else {
+      saved = false;
+    }
+
+    if (!saved) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    }
+  }
+
+  fprintf(stderr, "Cache: %lu hits, %lu misses\n", atomic_load(&cache->hits), atomic_load(&cache->misses));
+  destroy_cache(cache);
+
+  return saved;
+}
+
+static void write_cache(const struct solution_cache *cache, FILE *file) {
+  for (size_t i = 0; i < cache->set_count * CACHE_WAYS; ++i) {
+    const struct cache_entry *entry = &cache->entries[i];
+
+    if (entry->hash == 0) {
+      continue;
+    }
+
+    if (entry->solution[0] != 0) {
+      fprintf(file, "%.81s %.81s\n", entry->puzzle, entry->solution);
+    }
+    else {
+      fprintf(file, "%.81s\n", entry->puzzle);
+    }
+  }
+}
+
+/*
+
+  Parallel Search
+
+  The top of the search tree is expanded breadth first until there are
+  SUBTREES_PER_THREAD open subtrees per thread, then the threads pull
+  subtrees off a shared counter and search them depth first. The first
+  thread to find a solution raises the solved flag, which every other
+  search checks once per node and unwinds on.
+
+ */
+
+#define SUBTREES_PER_THREAD 8
+
+struct parallel_search {
+  uint16_t (*subtrees)[GRID_SIZE];
+  int count;
+  atomic_int next;
+  atomic_bool solved;
+  uint16_t *solution;
+#ifdef SUDOKU_STATS
+  pthread_mutex_t stats_lock;
+  struct solve_stats stats;
+#endif
+};
+
+static void *parallel_search_worker(void *arg) {
+  struct parallel_search *shared = arg;
+  struct solver solver;
+  int i;
+
+  STATS_RESET();
+
+  while ((i = atomic_fetch_add_explicit(&shared->next, 1, memory_order_relaxed)) < shared->count) {
+    init_solver(&solver, shared->subtrees[i]);
+
+    if (search(&solver, &shared->solved) &&
+	!atomic_exchange_explicit(&shared->solved, true, memory_order_acq_rel)) {
+      copy_grid(solver.grid, shared->solution);
+    }
+  }
+
+#ifdef SUDOKU_STATS
+  pthread_mutex_lock(&shared->stats_lock);
+  add_stats(&shared->stats, &solve_stats);
+  pthread_mutex_unlock(&shared->stats_lock);
+#endif
+
+  return NULL;
+}
+
+// Expands grid into open subtrees. Returns the number of subtrees, or -1
+// if the expansion itself reached a solution, which is then left in grid.
+static int expand_subtrees(uint16_t grid[81], uint16_t (*subtrees)[GRID_SIZE], int wanted) {
+  struct solver solver;
+  int first = 0;
+  int count = 1;
+
+  copy_grid(grid, subtrees[0]);
+
+  // Each expansion replaces one subtree by at most nine, so stop while
+  // there is still room for that.
+  while (count - first > 0 && count - first < wanted && count + 9 <= 2 * wanted) {
+    int square = 0;
+
+    if (!search_target(subtrees[first], &square)) {
+      copy_grid(subtrees[first], grid);
+      return -1;
+    }
+
+    const uint16_t values = subtrees[first][square];
+
+    for (int i = 0; i < 9; ++i) {
+      const uint16_t value = 1 << i;
+
+      if ((values & value) == 0) {
+	continue;
+      }
+
+      init_solver(&solver, subtrees[first]);
+
+      if (assign(&solver, square, value)) {
+	copy_grid(solver.grid, subtrees[count++]);
+      }
+    }
+
+    ++first;
+  }
+
+  memmove(subtrees, subtrees + first, sizeof(*subtrees) * (size_t)(count - first));
+
+  return count - first;
+}
+
+static _Bool parallel_search(uint16_t grid[81], int thread_count) {
+  const int wanted = thread_count * SUBTREES_PER_THREAD;
+  struct parallel_search shared = { .solution = grid };
+
+  // Zeroed so the padding of every subtree stays empty.
+  shared.subtrees = calloc(2 * (size_t)wanted, sizeof(*shared.subtrees));
+
+  if (shared.subtrees == NULL) {
+    struct solver solver;
+    init_solver(&solver, grid);
+
+    const _Bool solved = search(&solver, NULL);
+    copy_grid(solver.grid, grid);
+
+    return solved;
+  }
+
+  shared.count = expand_subtrees(grid, shared.subtrees, wanted);
+
+  if (shared.count < 0) {
+    free(shared.subtrees);
+    return true;
+  }
+
+  atomic_init(&shared.next, 0);
+  atomic_init(&shared.solved, false);
+
+#ifdef SUDOKU_STATS
+  // The calling thread's counters so far cover the expansion, and are set
+  // aside while it works as one of the searchers.
+  const struct solve_stats expansion_stats = solve_stats;
+  pthread_mutex_init(&shared.stats_lock, NULL);
+#endif
+
+  pthread_t threads[thread_count];
+  int started = 0;
+
+  while (started < thread_count - 1 &&
+	 pthread_create(&threads[started], NULL, parallel_search_worker, &shared) == 0) {
+    ++started;
+  }
+
+  parallel_search_worker(&shared);
+
+  for (int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(shared.subtrees);
+
+#ifdef SUDOKU_STATS
+  pthread_mutex_destroy(&shared.stats_lock);
+  solve_stats = expansion_stats;
+  add_stats(&solve_stats, &shared.stats);
+#endif
+
+  return atomic_load(&shared.solved);
+}
+
+static _Bool solve_in_parallel(const char puzzle[82], uint16_t grid[81], int thread_count) {
+  STATS_RESET();
+
+  struct solver solver;
+  init_solver(&solver, grid);
+
+  if (!assign_puzzle(puzzle, &solver)) {
+    return false;
+  }
+
+  copy_grid(solver.grid, grid);
+
+  return parallel_search(grid, thread_count);
+}
+
+#ifndef SUDOKU_LIBRARY
+
+int main(int argc, char **argv) {
+  select_search_target();
+  select_lockstep();
+
+  int thread_count = 1;
+  _Bool parallel_search = false;
+  const struct engine *engine = find_engine("auto");
+  int solution_limit = 0;
+  _Bool report_stats = false;
+  size_t cache_capacity = 0;
+  const char *cache_path = NULL;
+  long generate_count = 0;
+  int target_clues = 0;
+  uint64_t seed = (uint64_t)time(NULL);
+  _Bool benchmark = false;
+  _Bool test = false;
+  struct benchmark_options benchmark_options = {
+    .warmup = 1,
+    .repetitions = 10,
+    .format = BENCHMARK_TEXT,
+  };
+  const char *path = NULL;
+  const char *serve_address = NULL;
+  _Bool pack = false;
+  _Bool convert = false;
+  uint64_t node_budget = 0;
+  double deadline_seconds = 0;
+  int worker_count = 0;
+  const char *worker_command = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      thread_count = atoi(argv[++i]);
+
+      if (thread_count < 1) {
+	thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      }
+    }
+    else if (strcmp(argv[i], "--parallel-search") == 0) {
+      parallel_search = true;
+    }
+    else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      engine = find_engine(argv[++i]);
+
+      if (engine == NULL) {
+	fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--count-solutions") == 0 && i + 1 < argc) {
+      solution_limit = atoi(argv[++i]);
+
+      if (solution_limit < 1) {
+	fprintf(stderr, "Solution limit must be at least 1: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--stats") == 0) {
+#ifdef SUDOKU_STATS
+      report_stats = true;
+#else
+      fprintf(stderr, "--stats needs a build with -DSUDOKU_STATS\n");
+      return 1;
+#endif
+    }
+    else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      cache_capacity = strtoul(argv[++i], NULL, 10);
+
+      if (cache_capacity < 1) {
+	fprintf(stderr, "Cache capacity must be at least 1: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--cache-file") == 0 && i + 1 < argc) {
+      cache_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--canonical") == 0) {
+      benchmark_options.canonicalize = true;
+    }
+    else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+      generate_count = atol(argv[++i]);
+
+      if (generate_count < 1) {
+	fprintf(stderr, "Puzzle count must be at least 1: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--clues") == 0 && i + 1 < argc) {
+      target_clues = atoi(argv[++i]);
+
+      if (target_clues < 0 || target_clues > NUMBER_OF_SQUARES) {
+	fprintf(stderr, "Clues must be between 0 and 81: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--propagation") == 0 && i + 1 < argc) {
+      ++i;
+
+      int level = 0;
+
+      while (level < PROPAGATION_COUNT && strcmp(argv[i], PROPAGATION_NAMES[level]) != 0) {
+	++level;
+      }
+
+      if (strcmp(argv[i], "all") == 0) {
+	benchmark_options.all_propagation_levels = true;
+      }
+      else if (level < PROPAGATION_COUNT) {
+	propagation = (enum propagation)level;
+      }
+      else {
+	fprintf(stderr, "Unknown propagation level: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--value-order") == 0 && i + 1 < argc) {
+      ++i;
+
+      int order = 0;
+
+      while (order < VALUE_ORDER_COUNT && strcmp(argv[i], VALUE_ORDER_NAMES[order]) != 0) {
+	++order;
+      }
+
+      if (strcmp(argv[i], "all") == 0) {
+	benchmark_options.all_value_orders = true;
+      }
+      else if (order < VALUE_ORDER_COUNT) {
+	value_order = (enum value_order)order;
+      }
+      else {
+	fprintf(stderr, "Unknown value order: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--branching") == 0 && i + 1 < argc) {
+      ++i;
+
+      int choice = 0;
+
+      while (choice < BRANCHING_COUNT && strcmp(argv[i], BRANCHING_NAMES[choice]) != 0) {
+	++choice;
+      }
+
+      if (strcmp(argv[i], "all") == 0) {
+	benchmark_options.all_branchings = true;
+      }
+      else if (choice < BRANCHING_COUNT) {
+	branching = (enum branching)choice;
+      }
+      else {
+	fprintf(stderr, "Unknown branching: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--node-budget") == 0 && i + 1 < argc) {
+      node_budget = strtoull(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--deadline-us") == 0 && i + 1 < argc) {
+      deadline_seconds = strtod(argv[++i], NULL) * 1e-6;
+    }
+    else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      worker_count = atoi(argv[++i]);
+
+      if (worker_count < 1) {
+	fprintf(stderr, "Worker count must be at least 1: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--worker-command") == 0 && i + 1 < argc) {
+      worker_command = argv[++i];
+    }
+    else if (strcmp(argv[i], "--pack") == 0) {
+      pack = true;
+    }
+    else if (strcmp(argv[i], "--convert") == 0) {
+      convert = true;
+    }
+    else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serve_address = argv[++i];
+    }
+    else if (strcmp(argv[i], "--test") == 0) {
+      test = true;
+    }
+    else if (strcmp(argv[i], "--bench") == 0) {
+      benchmark = true;
+    }
+    else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      benchmark_options.warmup = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      benchmark_options.repetitions = atoi(argv[++i]);
+
+      if (benchmark_options.repetitions < 1) {
+	fprintf(stderr, "Repetitions must be at least 1: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      ++i;
+
+      if (strcmp(argv[i], "text") == 0) {
+	benchmark_options.format = BENCHMARK_TEXT;
+      }
+      else if (strcmp(argv[i], "csv") == 0) {
+	benchmark_options.format = BENCHMARK_CSV;
+      }
+      else if (strcmp(argv[i], "json") == 0) {
+	benchmark_options.format = BENCHMARK_JSON;
+      }
+      else {
+	fprintf(stderr, "Unknown format: %s\n", argv[i]);
+	return 1;
+      }
+    }
+    else {
+      path = argv[i];
+    }
+  }
+
+  benchmark_options.engine = engine;
+
+  if (node_budget > 0 || deadline_seconds > 0) {
+    const char *unbudgeted = parallel_search ? "--parallel-search" : benchmark ? "--bench" :
+      solution_limit > 0 ? "--count-solutions" :
+      engine->solve == bitboard_solve ? "--engine bitboard" :
+      engine->solve == box3_solve ? "--engine generic" : NULL;
+
+    if (unbudgeted != NULL) {
+      fprintf(stderr, "--node-budget and --deadline-us do not work with %s\n", unbudgeted);
+      return 1;
+    }
+  }
+
+  if (test) {
+    run_tests();
+    return 0;
+  }
+
+  if ((pack || convert) && solution_limit > 0) {
+    fprintf(stderr, "--pack and --convert write puzzles or solutions, not counts\n");
+    return 1;
+  }
+
+  if (generate_count > 0) {
+    fprintf(stderr, "Seed: %llu\n", (unsigned long long)seed);
+
+    return generate_puzzles(generate_count, target_clues, seed, thread_count) ? 0 : 1;
+  }
+
+  struct solution_cache *cache = NULL;
+
+  if (cache_capacity > 0 || cache_path != NULL) {
+    cache = load_cache(cache_capacity > 0 ? cache_capacity : DEFAULT_CACHE_CAPACITY, cache_path);
+
+    if (cache == NULL) {
+      fprintf(stderr, "Could not allocate the cache\n");
+      return 1;
+    }
+  }
+
+  if (benchmark) {
+    benchmark_options.cache = cache;
+
+    const _Bool ok = run_benchmark(path, &benchmark_options);
+
+    return (cache == NULL || save_cache(cache, cache_path)) && ok ? 0 : 1;
+  }
+
+  if (serve_address != NULL) {
+    const struct solve_options options = {
+      .engine = engine,
+      .search_threads = 1,
+      .solution_limit = solution_limit,
+      .cache = cache,
+      .node_budget = node_budget,
+      .deadline_seconds = deadline_seconds,
+    };
+
+    _Bool ok = serve(serve_address, thread_count, &options);
+
+    if (cache != NULL) {
+      ok = save_cache(cache, cache_path) && ok;
+    }
+
+    return ok ? 0 : 1;
+  }
+
+  if (path != NULL && worker_count > 0) {
+    if (pack || convert) {
+      fprintf(stderr, "--workers writes solutions as text\n");
+      return 1;
+    }
+
+    const struct solve_options options = {
+      .engine = engine,
+      .solution_limit = solution_limit,
+      .node_budget = node_budget,
+      .deadline_seconds = deadline_seconds,
+    };
+    struct coordinator_stats stats;
+
+    const double start = monotonic_seconds();
+    const _Bool ok = coordinate(path, STDOUT_FILENO, worker_count, worker_command, &options, &stats);
+
+    fprintf(stderr, "workers %d shards %ld lines %ld empty %ld timed_out %ld retries %ld seconds %.3f\n",
+	    worker_count, stats.shards, stats.lines, stats.empty, stats.timed_out, stats.retries,
+	    monotonic_seconds() - start);
+
+    return ok ? 0 : 1;
+  }
+
+  if (path != NULL) {
+    // With --parallel-search the threads work on one puzzle at a time.
+    const struct solve_options options = {
+      .engine = engine,
+      .search_threads = parallel_search ? thread_count : 1,
+      .report_speedup = parallel_search,
+      .solution_limit = solution_limit,
+      .report_stats = report_stats,
+      .cache = cache,
+      .packed_output = pack,
+      .convert = convert,
+      .node_budget = node_budget,
+      .deadline_seconds = deadline_seconds,
+    };
+
+    _Bool ok = solve_puzzle_file(path, parallel_search ? 1 : thread_count, &options);
+
+    if (atomic_load(&timed_out_count) > 0) {
+      fprintf(stderr, "%ld puzzles ran out of budget\n", atomic_load(&timed_out_count));
+    }
+
+    if (cache != NULL) {
+      ok = save_cache(cache, cache_path) && ok;
+    }
+
+#ifdef SUDOKU_STATS
+    if (report_stats) {
+      fprintf(stderr, "total ");
+      print_stats(stderr, &total_stats);
+      fputc('\n', stderr);
+    }
+#endif
+
+    return ok ? 0 : 1;
+  }
+
+  run_tests();
+
+  /*
+  //const char puzzle[] = "003020600900305001001806400008102900700000008006708200002609500800203009005010300";
+  //const char puzzle[] = "4.....8.5.3..........7......2.....6.....8.4......1.......6.3.7.5..2.....1.4......";
+  const char puzzle[] = "..1..6.9.5.....1.....3..4.6..9..7....4.6.3.7....2..9..4.6..9.....8.....5.3.4..8..";
+
+  uint16_t grid[81] = {0};
+  default_grid_values(grid);
+
+  (void)solve(puzzle, grid);
+  */
+
+  return run_benchmark(NULL, &benchmark_options) ? 0 : 1;
+}
+
+/*
+
+  Packed Format
+
+  A binary format for 9×9 puzzles and solutions: a header, then records of
+  81 four bit squares, two to a byte with the first square in the low half.
+  0 is an empty square and 1 to 9 a value. A record whose first square is
+  PACKED_EMPTY_LINE stands for an empty line of text, which is what lines
+  that are not puzzles and puzzles without solutions become.
+
+  The header is PACKED_MAGIC, a version byte, three zero bytes and the
+  record count as a little endian 64 bit number. The count is
+  PACKED_UNKNOWN_COUNT when the writer could not seek back to fill it in,
+  and the records then run to the end of the file. Records have a fixed
+  size, so a mapped file splits anywhere on a multiple of the record size.
+
+ */
+
+#define PACKED_MAGIC "SDKP"
+#define PACKED_VERSION 1
+#define PACKED_HEADER_SIZE 16
+#define PACKED_RECORD_SIZE ((NUMBER_OF_SQUARES + 1) / 2)
+#define PACKED_UNKNOWN_COUNT UINT64_MAX
+#define PACKED_EMPTY_LINE 15
+
+static void pack_header(uint64_t count, char header[PACKED_HEADER_SIZE]) {
+  memcpy(header, PACKED_MAGIC, 4);
+  header[4] = PACKED_VERSION;
+  header[5] = header[6] = header[7] = 0;
+
+  for (int i = 0; i < 8; ++i) {
+    header[8 + i] = (char)(count >> 8 * i);
+  }
+}
+
+// Returns whether data starts with a packed header, and if so its count.
+static _Bool unpack_header(const char *data, size_t size, uint64_t *count) {
+  if (size < PACKED_HEADER_SIZE || memcmp(data, PACKED_MAGIC, 4) != 0 || data[4] != PACKED_VERSION) {
+    return false;
+  }
+
+  *count = 0;
+
+  for (int i = 0; i < 8; ++i) {
+    *count |= (uint64_t)(uint8_t)data[8 + i] << 8 * i;
+  }
+
+  return true;
+}
+
+static inline void pack_empty_line(char record[PACKED_RECORD_SIZE]) {
+  memset(record, 0, PACKED_RECORD_SIZE);
+  record[0] = PACKED_EMPTY_LINE;
+}
+
+// Packs a line of text, which becomes an empty line if it is not a puzzle.
+static void pack_puzzle(const char *line, size_t length, char record[PACKED_RECORD_SIZE]) {
+  if (length > 0 && line[length - 1] == '\r') {
+    --length;
+  }
+
+  if (length != NUMBER_OF_SQUARES) {
+    pack_empty_line(record);
+    return;
+  }
+
+  memset(record, 0, PACKED_RECORD_SIZE);
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    int value = 0;
+
+    if (line[i] >= '1' && line[i] <= '9') {
+      value = line[i] - '0';
+    }
+    else if (line[i] != '.' && line[i] != '0') {
+      pack_empty_line(record);
+      return;
+    }
+
+    record[i / 2] |= (char)(value << i % 2 * 4);
+  }
+}
+
+static void pack_grid(const uint16_t grid[81], char record[PACKED_RECORD_SIZE]) {
+  memset(record, 0, PACKED_RECORD_SIZE);
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    record[i / 2] |= (char)((__builtin_ctz(grid[i]) + 1) << i % 2 * 4);
+  }
+}
+
+// Writes the puzzle in record as text, failing for empty lines.
+static _Bool unpack_puzzle(const char record[PACKED_RECORD_SIZE], char puzzle[82]) {
+  static const char symbols[] = ".123456789";
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const int value = (uint8_t)record[i / 2] >> i % 2 * 4 & 0xF;
+
+    if (value > 9) {
+      return false;
+    }
+
+    puzzle[i] = symbols[value];
+  }
+
+  puzzle[NUMBER_OF_SQUARES] = '\0';
+
+  return true;
+}
+
+/*
+
+  Batch
+
+  One puzzle per line in, one solution per line out. Lines that are not
+  exactly 16, 81, 256 or 625 characters (ignoring a trailing '\r') or that
+  have no solution produce an empty line so output stays aligned with input.
+  The length of a line gives its size. Either side may instead be a packed
+  file, whose records take the place of lines.
+
+ */
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define INPUT_BUFFER_SIZE (1 << 20)
+
+struct output_buffer {
+  int fd;
+  const struct solve_options *options;
+  size_t used;
+  char data[OUTPUT_BUFFER_SIZE];
+};
+
+static _Bool write_all(int fd, const char *data, size_t size) {
+  size_t written = 0;
+
+  while (written < size) {
+    const ssize_t result = write(fd, data + written, size - written);
+
+    if (result < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+
+      perror("write");
+      return false;
+    }
+
+    written += (size_t)result;
+  }
+
+  return true;
+}
+
+static _Bool flush_output(struct output_buffer *out) {
+  if (!write_all(out->fd, out->data, out->used)) {
+    return false;
+  }
+
+  out->used = 0;
+
+  return true;
+}
+
+// Solves the puzzle with parallel tree search, and if asked also serially
+// to report the speedup on stderr.
+static _Bool solve_reporting_speedup(const struct solve_options *options, const char puzzle[82],
+				     uint16_t grid[81]) {
+  double serial_seconds = 0;
+
+  if (options->report_speedup) {
+    uint16_t serial_grid[81] = {0};
+    default_grid_values(serial_grid);
+
+    const double start = monotonic_seconds();
+    (void)solve(puzzle, serial_grid);
+    serial_seconds = monotonic_seconds() - start;
+  }
+
+  const double start = monotonic_seconds();
+  const _Bool solved = solve_in_parallel(puzzle, grid, options->search_threads);
+  const double parallel_seconds = monotonic_seconds() - start;
+
+  if (options->report_speedup) {
+    fprintf(stderr, "%.81s serial %.3f ms, %d threads %.3f ms, speedup %.2fx\n",
+	    puzzle, serial_seconds * 1e3, options->search_threads, parallel_seconds * 1e3,
+	    serial_seconds / parallel_seconds);
+  }
+
+  return solved;
+}
+
+// Solves a 9×9 puzzle the way options ask, leaving the solution in grid.
+// When it runs out of budget, grid holds what propagation solved and
+// solve_budget.exhausted is set. Parallel search takes no budget, and the
+// command line does not allow one with it.
+static _Bool solve_grid(const struct solve_options *options, const char puzzle[82], uint16_t grid[81]) {
+  default_grid_values(grid);
+  start_budget(0, 0);
+
+  _Bool solved;
+
+  if (options->search_threads > 1) {
+    solved = solve_reporting_speedup(options, puzzle, grid);
+  }
+  else if (options->cache != NULL) {
+    start_budget(options->node_budget, options->deadline_seconds);
+    solved = solve_cached(options->cache, options->engine, puzzle, grid);
+  }
+  else {
+    start_budget(options->node_budget, options->deadline_seconds);
+    solved = options->engine->solve(puzzle, grid);
+  }
+
+  if (solve_budget.exhausted) {
+    atomic_fetch_add_explicit(&timed_out_count, 1, memory_order_relaxed);
+  }
+
+#ifdef SUDOKU_STATS
+  if (options->report_stats) {
+    report_stats(puzzle);
+  }
+#endif
+
+  return solved;
+}
+
+// Writes the squares of grid with one value left, and '.' for the rest.
+static void format_partial_grid(const uint16_t grid[81], char *dest) {
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    dest[i] = grid[i] != 0 && (grid[i] & (grid[i] - 1)) == 0 ? (char)('1' + __builtin_ctz(grid[i])) : '.';
+  }
+}
+
+// Writes the solution of line and a newline to dest, returning the end of
+// what was written, or the number of solutions when counting. A puzzle that
+// runs out of budget gets what propagation solved of it, which is a puzzle
+// to retry. Never writes more than length + 1 bytes.
+static char *format_solution(const struct solve_options *options, const char *line, size_t length, char *dest) {
+  const struct puzzle_size *size;
+
+  if (length > 0 && line[length - 1] == '\r') {
+    --length;
+  }
+
+  if (length == NUMBER_OF_SQUARES && options->solution_limit > 0) {
+    dest += sprintf(dest, "%d", count_solutions(line, options->solution_limit));
+
+#ifdef SUDOKU_STATS
+    if (options->report_stats) {
+      report_stats(line);
+    }
+#endif
+  }
+  else if (length == NUMBER_OF_SQUARES) {
+    uint16_t grid[81] = {0};
+
+    if (solve_grid(options, line, grid)) {
+      for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+	dest[i] = (char)('1' + __builtin_ctz(grid[i]));
+      }
+
+      dest += NUMBER_OF_SQUARES;
+    }
+    else if (solve_budget.exhausted) {
+      format_partial_grid(grid, dest);
+      dest += NUMBER_OF_SQUARES;
+    }
+  }
+  else if ((size = find_puzzle_size(length)) != NULL) {
+    if (options->solution_limit > 0) {
+      dest += sprintf(dest, "%d", size->count_solutions(line, options->solution_limit));
+    }
+    else if (size->solve_line(line, dest)) {
+      dest += length;
+    }
+
+#ifdef SUDOKU_STATS
+    if (options->report_stats) {
+      report_stats(line);
+    }
+#endif
+  }
+
+  *dest++ = '\n';
+
+  return dest;
+}
+
+// Writes what record becomes to dest, returning the end of what was
+// written: the solution, or with options->convert the puzzle itself, as a
+// line of text or a packed record. A packed record that is cut short reads
+// as an empty line, and so does a line that is not a puzzle of some size,
+// so nothing longer than MAX_SQUARES + 1 bytes is ever written.
+static char *format_record(const struct solve_options *options, const char *record, size_t length, char *dest) {
+  char puzzle[82];
+
+  if (options->packed_input) {
+    const _Bool complete = length == PACKED_RECORD_SIZE && unpack_puzzle(record, puzzle);
+
+    record = puzzle;
+    length = complete ? NUMBER_OF_SQUARES : 0;
+  }
+
+  if (options->convert && options->packed_output) {
+    pack_puzzle(record, length, dest);
+    return dest + PACKED_RECORD_SIZE;
+  }
+
+  if (options->convert) {
+    if (length > 0 && record[length - 1] == '\r') {
+      --length;
+    }
+
+    if (length != NUMBER_OF_SQUARES && find_puzzle_size(length) == NULL) {
+      length = 0;
+    }
+
+    memcpy(dest, record, length);
+    dest[length] = '\n';
+    return dest + length + 1;
+  }
+
+  if (options->packed_output) {
+    uint16_t grid[81] = {0};
+
+    if (length > 0 && record[length - 1] == '\r') {
+      --length;
+    }
+
+    if (length == NUMBER_OF_SQUARES && solve_grid(options, record, grid)) {
+      pack_grid(grid, dest);
+    }
+    else if (length == NUMBER_OF_SQUARES && solve_budget.exhausted) {
+      char partial[NUMBER_OF_SQUARES];
+
+      format_partial_grid(grid, partial);
+      pack_puzzle(partial, NUMBER_OF_SQUARES, dest);
+    }
+    else {
+      pack_empty_line(dest);
+    }
+
+    return dest + PACKED_RECORD_SIZE;
+  }
+
+  return format_solution(options, record, length, dest);
+}
+
+// Finds the complete record at begin, setting its length and returning
+// where the next one starts, or returns NULL if it runs past end.
+static const char *next_record(const struct solve_options *options, const char *begin, const char *end,
+			       size_t *length) {
+  if (options->packed_input) {
+    if ((size_t)(end - begin) < PACKED_RECORD_SIZE) {
+      return NULL;
+    }
+
+    *length = PACKED_RECORD_SIZE;
+
+    return begin + PACKED_RECORD_SIZE;
+  }
+
+  const char *newline = memchr(begin, '\n', (size_t)(end - begin));
+
+  if (newline == NULL) {
+    return NULL;
+  }
+
+  *length = (size_t)(newline - begin);
+
+  return newline + 1;
+}
+
+// Returns the end of the last complete record in [begin, end).
+static const char *complete_records_end(const struct solve_options *options, const char *begin, const char *end) {
+  if (options->packed_input) {
+    return begin + (size_t)(end - begin) / PACKED_RECORD_SIZE * PACKED_RECORD_SIZE;
+  }
+
+  while (end > begin && end[-1] != '\n') {
+    --end;
+  }
+
+  return end;
+}
+
+// The most that the records in [begin, end) can write.
+static size_t output_bound(const struct solve_options *options, const char *begin, const char *end) {
+  const size_t size = (size_t)(end - begin);
+
+  if (!options->packed_input && !options->packed_output) {
+    // No line grows by more than the newline that a final line may lack.
+    return size + 1;
+  }
+
+  size_t records = 1;
+
+  if (options->packed_input) {
+    records = (size + PACKED_RECORD_SIZE - 1) / PACKED_RECORD_SIZE;
+  }
+  else {
+    for (const char *newline = begin; (newline = memchr(newline, '\n', (size_t)(end - newline))) != NULL; ++newline) {
+      ++records;
+    }
+  }
+
+  return records * (options->packed_output ? PACKED_RECORD_SIZE : NUMBER_OF_SQUARES + 1);
+}
+
+// Writes what up to LOCKSTEP_LANES complete records from begin become, as
+// format_record does, after trying the 9×9 puzzles among them in lockstep
+// when options allow. Returns where the next record starts, which is begin
+// if there is no complete record.
+static const char *format_records(const struct solve_options *options, const char *begin, const char *end,
+				  char **dest) {
+  const _Bool lockstep = lockstep_solve != NULL && options->engine->lockstep && options->solution_limit == 0 &&
+    options->search_threads == 1 && options->cache == NULL && !options->report_stats && !options->convert;
+  const char *records[LOCKSTEP_LANES];
+  size_t lengths[LOCKSTEP_LANES];
+  int record_lanes[LOCKSTEP_LANES];
+  const char *puzzles[LOCKSTEP_LANES];
+  char unpacked[LOCKSTEP_LANES][82];
+  int count = 0;
+  int lane_count = 0;
+  const char *next;
+  size_t length;
+
+  while (count < LOCKSTEP_LANES && begin < end && (next = next_record(options, begin, end, &length)) != NULL) {
+    const char *puzzle = NULL;
+
+    if (lockstep && options->packed_input) {
+      if (length == PACKED_RECORD_SIZE && unpack_puzzle(begin, unpacked[lane_count])) {
+	puzzle = unpacked[lane_count];
+      }
+    }
+    else if (lockstep && (length == NUMBER_OF_SQUARES ||
+			  (length == NUMBER_OF_SQUARES + 1 && begin[NUMBER_OF_SQUARES] == '\r'))) {
+      puzzle = begin;
+    }
+
+    record_lanes[count] = puzzle != NULL ? lane_count : -1;
+
+    if (puzzle != NULL) {
+      puzzles[lane_count++] = puzzle;
+    }
+
+    records[count] = begin;
+    lengths[count++] = length;
+    begin = next;
+  }
+
+  uint16_t grids[LOCKSTEP_LANES][81];
+  const unsigned solved = lane_count > 0 ? lockstep_solve(puzzles, lane_count, grids) : 0;
+
+  for (int i = 0; i < count; ++i) {
+    const int lane = record_lanes[i];
+
+    if (lane < 0 || (solved >> lane & 1) == 0) {
+      *dest = format_record(options, records[i], lengths[i], *dest);
+    }
+    else if (options->packed_output) {
+      pack_grid(grids[lane], *dest);
+      *dest += PACKED_RECORD_SIZE;
+    }
+    else {
+      for (int j = 0; j < NUMBER_OF_SQUARES; ++j) {
+	(*dest)[j] = (char)('1' + __builtin_ctz(grids[lane][j]));
+      }
+
+      (*dest)[NUMBER_OF_SQUARES] = '\n';
+      *dest += NUMBER_OF_SQUARES + 1;
+    }
+  }
+
+  return begin;
+}
+
+static _Bool write_solution(struct output_buffer *out, const char *record, size_t length) {
+  if (OUTPUT_BUFFER_SIZE - out->used < MAX_SQUARES + 1 && !flush_output(out)) {
+    return false;
+  }
+
+  out->used = (size_t)(format_record(out->options, record, length, out->data + out->used) - out->data);
+
+  return true;
+}
+
+// Solves every complete record in [begin, end) in place. Returns a pointer
+// to the first byte of the trailing partial record, or NULL if writing
+// failed.
+static const char *solve_lines(const char *begin, const char *end, struct output_buffer *out) {
+  while (begin < end) {
+    if (OUTPUT_BUFFER_SIZE - out->used < LOCKSTEP_LANES * (MAX_SQUARES + 1) && !flush_output(out)) {
+      return NULL;
+    }
+
+    char *dest = out->data + out->used;
+    const char *next = format_records(out->options, begin, end, &dest);
+
+    out->used = (size_t)(dest - out->data);
+
+    if (next == begin) {
+      break;
+    }
+
+    begin = next;
+  }
+
+  return begin;
+}
+
+/*
+
+  Thread Pool
+
+  The input is cut into chunks of about CHUNK_SIZE bytes on line
+  boundaries and handed out in rounds. Each worker owns a contiguous range
+  of the round's chunks and takes from its front; a worker that runs dry
+  steals the back half of another worker's range. Ranges are packed
+  [lo, hi) pairs of absolute chunk numbers updated with compare and swap,
+  so numbers are never reused and a stale compare always fails. The main
+  thread writes finished chunks in input order.
+
+ */
+
+#define CHUNK_SIZE (1 << 14)
+#define CHUNKS_PER_THREAD 64
+
+struct chunk {
+  const struct solve_options *options;
+  const char *begin;
+  const char *end;
+  _Bool at_eof;
+  _Bool done;
+  char *output;
+  size_t output_used;
+};
+
+struct worker {
+  _Alignas(64) _Atomic uint64_t range;
+  pthread_t thread;
+  struct pool *pool;
+  int id;
+};
+
+struct pool {
+  int thread_count;
+  struct worker *workers;
+  uint32_t round_size;
+  uint32_t first_chunk;
+  struct chunk *chunks;
+  char *output;
+  size_t output_size;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_ready;
+  pthread_cond_t chunk_done;
+  unsigned generation;
+  _Bool stop;
+};
+
+static inline uint64_t make_range(uint32_t lo, uint32_t hi) {
+  return (uint64_t)hi << 32 | lo;
+}
+
+static _Bool take_chunk(struct worker *worker, uint32_t *index) {
+  uint64_t range = atomic_load_explicit(&worker->range, memory_order_acquire);
+
+  for (;;) {
+    const uint32_t lo = (uint32_t)range;
+    const uint32_t hi = (uint32_t)(range >> 32);
+
+    if (lo >= hi) {
+      return false;
+    }
+
+    if (atomic_compare_exchange_weak_explicit(&worker->range, &range, make_range(lo + 1, hi),
+					      memory_order_acq_rel, memory_order_acquire)) {
+      *index = lo;
+      return true;
+    }
+  }
+}
+
+static _Bool steal_chunks(struct worker *thief, uint32_t *index) {
+  const struct pool *pool = thief->pool;
+
+  for (int i = 1; i < pool->thread_count; ++i) {
+    struct worker *victim = &pool->workers[(thief->id + i) % pool->thread_count];
+    uint64_t range = atomic_load_explicit(&victim->range, memory_order_acquire);
+
+    for (;;) {
+      const uint32_t lo = (uint32_t)range;
+      const uint32_t hi = (uint32_t)(range >> 32);
+
+      if (lo >= hi) {
+	break;
+      }
+
+      const uint32_t stolen = (hi - lo + 1) / 2;
+
+      if (atomic_compare_exchange_weak_explicit(&victim->range, &range, make_range(lo, hi - stolen),
+						memory_order_acq_rel, memory_order_acquire)) {
+	*index = hi - stolen;
+	atomic_store_explicit(&thief->range, make_range(hi - stolen + 1, hi), memory_order_release);
+	return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+static void solve_chunk(struct chunk *chunk) {
+  const char *begin = chunk->begin;
+  char *dest = chunk->output;
+
+  while (begin < chunk->end) {
+    const char *next = format_records(chunk->options, begin, chunk->end, &dest);
+
+    if (next == begin) {
+      dest = format_record(chunk->options, begin, (size_t)(chunk->end - begin), dest);
+      break;
+    }
+
+    begin = next;
+  }
+
+  chunk->output_used = (size_t)(dest - chunk->output);
+}
+
+static void *worker_main(void *arg) {
+  struct worker *worker = arg;
+  struct pool *pool = worker->pool;
+  unsigned seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!pool->stop && pool->generation == seen) {
+      pthread_cond_wait(&pool->work_ready, &pool->mutex);
+    }
+
+    const _Bool stop = pool->stop;
+    seen = pool->generation;
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (stop) {
+      return NULL;
+    }
+
+    uint32_t index;
+
+    while (take_chunk(worker, &index) || steal_chunks(worker, &index)) {
+      struct chunk *chunk = &pool->chunks[index % pool->round_size];
+
+      solve_chunk(chunk);
+
+      pthread_mutex_lock(&pool->mutex);
+      chunk->done = true;
+      pthread_cond_broadcast(&pool->chunk_done);
+      pthread_mutex_unlock(&pool->mutex);
+    }
+  }
+}
+
+static struct pool *create_pool(int thread_count) {
+  const uint32_t round_size = (uint32_t)thread_count * CHUNKS_PER_THREAD;
+  struct pool *pool = calloc(1, sizeof(*pool));
+  struct worker *workers = aligned_alloc(_Alignof(struct worker), sizeof(*workers) * (size_t)thread_count);
+  struct chunk *chunks = calloc(round_size, sizeof(*chunks));
+
+  if (pool == NULL || workers == NULL || chunks == NULL) {
+    perror("create_pool");
+    exit(1);
+  }
+
+  pool->thread_count = thread_count;
+  pool->workers = workers;
+  pool->round_size = round_size;
+  pool->chunks = chunks;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->chunk_done, NULL);
+
+  for (int i = 0; i < thread_count; ++i) {
+    atomic_init(&workers[i].range, 0);
+    workers[i].pool = pool;
+    workers[i].id = i;
+
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  return pool;
+}
+
+static void destroy_pool(struct pool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 0; i < pool->thread_count; ++i) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+
+  pthread_cond_destroy(&pool->chunk_done);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->output);
+  free(pool->chunks);
+  free(pool->workers);
+  free(pool);
+}
+
+static const char *next_line_start(const char *position, const char *end) {
+  if (position >= end) {
+    return end;
+  }
+
+  const char *newline = memchr(position - 1, '\n', (size_t)(end - position + 1));
+
+  return newline == NULL ? end : newline + 1;
+}
+
+// Solves one round of up to round_size chunks starting at begin and writes
+// the results to fd in order. Returns where the next round starts, or NULL
+// if writing failed.
+static const char *solve_round(struct pool *pool, const struct solve_options *options,
+			       const char *begin, const char *end, _Bool at_eof, int fd) {
+  uint32_t count = 0;
+  const char *position = begin;
+
+  while (position < end && count < pool->round_size) {
+    struct chunk *chunk = &pool->chunks[count++];
+    const char *next = end;
+
+    if (end - position > CHUNK_SIZE) {
+      next = options->packed_input ? position + CHUNK_SIZE / PACKED_RECORD_SIZE * PACKED_RECORD_SIZE :
+	next_line_start(position + CHUNK_SIZE, end);
+    }
+
+    chunk->options = options;
+    chunk->begin = position;
+    chunk->end = next;
+    chunk->at_eof = at_eof && next == end;
+    chunk->done = false;
+    position = next;
+  }
+
+  size_t output_size = 0;
+
+  // Output offsets, until the buffer is allocated.
+  for (uint32_t i = 0; i < count; ++i) {
+    pool->chunks[i].output_used = output_size;
+    output_size += output_bound(options, pool->chunks[i].begin, pool->chunks[i].end);
+  }
+
+  if (output_size > pool->output_size) {
+    free(pool->output);
+    pool->output = malloc(output_size);
+    pool->output_size = output_size;
+
+    if (pool->output == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    pool->chunks[i].output = pool->output + pool->chunks[i].output_used;
+  }
+
+  const uint32_t first = pool->first_chunk;
+  pool->first_chunk += pool->round_size;
+
+  for (int i = 0; i < pool->thread_count; ++i) {
+    const uint32_t lo = first + (uint32_t)((uint64_t)count * (uint32_t)i / (uint32_t)pool->thread_count);
+    const uint32_t hi = first + (uint32_t)((uint64_t)count * (uint32_t)(i + 1) / (uint32_t)pool->thread_count);
+
+    atomic_store_explicit(&pool->workers[i].range, make_range(lo, hi), memory_order_release);
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  ++pool->generation;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->mutex);
+
+  _Bool ok = true;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    struct chunk *chunk = &pool->chunks[i];
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!chunk->done) {
+      pthread_cond_wait(&pool->chunk_done, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    ok = ok && write_all(fd, chunk->output, chunk->output_used);
+  }
+
+  return ok ? position : NULL;
+}
+
+/*
+
+  Batch Input
+
+ */
+
+struct batch {
+  // Shared with out, which reads it.
+  struct solve_options *options;
+  struct output_buffer *out;
+  struct pool *pool;
+};
+
+// Solves the complete lines in [begin, end), and the trailing partial line
+// too if at_eof. Returns a pointer to what was not consumed, or NULL if
+// writing failed.
+static const char *solve_region(struct batch *batch, const char *begin, const char *end, _Bool at_eof) {
+  if (batch->pool == NULL) {
+    const char *rest = solve_lines(begin, end, batch->out);
+
+    if (rest != NULL && at_eof && rest < end) {
+      return write_solution(batch->out, rest, (size_t)(end - rest)) ? end : NULL;
+    }
+
+    return rest;
+  }
+
+  if (!at_eof) {
+    end = complete_records_end(batch->options, begin, end);
+  }
+
+  if (!flush_output(batch->out)) {
+    return NULL;
+  }
+
+  while (begin != NULL && begin < end) {
+    begin = solve_round(batch->pool, batch->out->options, begin, end, at_eof, batch->out->fd);
+  }
+
+  return begin;
+}
+
+static _Bool solve_mapped_file(int fd, size_t size, struct batch *batch) {
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  (void)madvise(data, size, MADV_SEQUENTIAL);
+
+  const char *begin = data;
+  const char *end = data + size;
+  uint64_t count;
+
+  if (unpack_header(data, size, &count)) {
+    batch->options->packed_input = true;
+    begin += PACKED_HEADER_SIZE;
+
+    if (count != PACKED_UNKNOWN_COUNT && count <= (size - PACKED_HEADER_SIZE) / PACKED_RECORD_SIZE) {
+      end = begin + count * PACKED_RECORD_SIZE;
+    }
+    else if (count != PACKED_UNKNOWN_COUNT) {
+      fprintf(stderr, "Packed file is missing records\n");
+    }
+  }
+
+  const _Bool ok = solve_region(batch, begin, end, true) != NULL;
+
+  munmap(data, size);
+
+  return ok;
+}
+
+static _Bool solve_streamed_file(int fd, struct batch *batch) {
+  const size_t buffer_size = batch->pool == NULL ? INPUT_BUFFER_SIZE :
+    (size_t)batch->pool->round_size * CHUNK_SIZE;
+  char *buffer = malloc(buffer_size);
+  size_t pending = 0;
+  _Bool skipping = false;
+  _Bool ok = buffer != NULL;
+
+  // Read enough to tell a packed header from text.
+  while (ok && pending < PACKED_HEADER_SIZE) {
+    const ssize_t result = read(fd, buffer + pending, PACKED_HEADER_SIZE - pending);
+
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (result < 0) {
+      perror("read");
+      ok = false;
+    }
+
+    if (result <= 0) {
+      break;
+    }
+
+    pending += (size_t)result;
+  }
+
+  uint64_t count;
+
+  if (ok && unpack_header(buffer, pending, &count)) {
+    batch->options->packed_input = true;
+    pending = 0;
+  }
+
+  while (ok) {
+    const ssize_t result = read(fd, buffer + pending, buffer_size - pending);
+
+    if (result < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+
+      perror("read");
+      ok = false;
+      break;
+    }
+
+    if (result == 0) {
+      break;
+    }
+
+    const char *begin = buffer;
+    const char *end = buffer + pending + (size_t)result;
+
+    if (skipping) {
+      // Discard the remainder of an overlong line.
+      const char *newline = memchr(begin, '\n', (size_t)(end - begin));
+
+      if (newline == NULL) {
+	pending = 0;
+	continue;
+      }
+
+      skipping = false;
+      begin = newline + 1;
+    }
+
+    const char *rest = solve_region(batch, begin, end, false);
+
+    if (rest == NULL) {
+      ok = false;
+      break;
+    }
+
+    pending = (size_t)(end - rest);
+
+    if (pending == buffer_size) {
+      ok = write_solution(batch->out, rest, 0);
+      pending = 0;
+      skipping = true;
+    }
+    else {
+      memmove(buffer, rest, pending);
+    }
+  }
+
+  if (ok && pending > 0 && !skipping) {
+    ok = solve_region(batch, buffer, buffer + pending, true) != NULL;
+  }
+
+  free(buffer);
+
+  return ok;
+}
+
+// Solves the puzzles in path, or stdin if path is "-", writing solutions
+// to stdout. Regular files are memory mapped and parsed in place. With more
+// than one thread the puzzles are solved by a work stealing pool.
+static _Bool solve_puzzle_file(const char *path, int thread_count, const struct solve_options *options) {
+  static struct output_buffer out = { .fd = STDOUT_FILENO };
+  struct solve_options file_options = *options;
+
+  out.options = &file_options;
+
+  const _Bool is_stdin = strcmp(path, "-") == 0;
+  const int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+
+  // Where the packed header goes, for filling in the count at the end.
+  const off_t header_offset = options->packed_output ? lseek(out.fd, 0, SEEK_CUR) : -1;
+
+  if (options->packed_output) {
+    pack_header(PACKED_UNKNOWN_COUNT, out.data);
+    out.used = PACKED_HEADER_SIZE;
+  }
+
+  struct batch batch = { &file_options, &out, thread_count > 1 ? create_pool(thread_count) : NULL };
+  struct stat info;
+  _Bool ok;
+
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    ok = solve_mapped_file(fd, (size_t)info.st_size, &batch);
+  }
+  else {
+    ok = solve_streamed_file(fd, &batch);
+  }
+
+  if (!is_stdin) {
+    close(fd);
+  }
+
+  if (batch.pool != NULL) {
+    destroy_pool(batch.pool);
+  }
+
+  ok = flush_output(&out) && ok;
+
+  if (ok && header_offset >= 0) {
+    const off_t end = lseek(out.fd, 0, SEEK_CUR);
+    char header[PACKED_HEADER_SIZE];
+
+    pack_header((uint64_t)(end - header_offset - PACKED_HEADER_SIZE) / PACKED_RECORD_SIZE, header);
+    ok = pwrite(out.fd, header, PACKED_HEADER_SIZE, header_offset) == PACKED_HEADER_SIZE;
+  }
+
+  return ok;
+}
+
+/*
+
+  Generator
+
+  A full grid comes from searching the empty grid with values tried in
+  random order. Clues are then removed in random order, keeping each removal
+  only if the puzzle stays unique, until the target number of clues is
+  reached or no clue can go. Every puzzle has its own seed derived from the
+  run's seed and its number, so the output does not depend on the number of
+  threads.
+
+ */
+
+// Fresh grids tried for a puzzle that does not get down to the target.
+#define GENERATOR_ATTEMPTS 64
+#define PUZZLES_PER_ROUND 256
+
+// Whether puzzle has a solution without value at square. A puzzle that just
+// lost its clue at square is unique exactly when it has none, which is
+// cheaper to settle than counting up to two solutions.
+static _Bool has_other_solution(const char puzzle[82], int square, uint16_t value) {
+  uint16_t grid[81] = {0};
+  default_grid_values(grid);
+  grid[square] &= (uint16_t)~value;
+
+  struct solver solver;
+  init_solver(&solver, grid);
+
+  return assign_puzzle(puzzle, &solver) && search(&solver, NULL);
+}
+
+// Generates one unique puzzle from a random grid, removing clues down to
+// target_clues, or as far as possible if that is zero. Returns the number of
+// clues left.
+static int generate_from_grid(uint64_t *random, int target_clues, char puzzle[82]) {
+  uint16_t grid[81] = {0};
+  default_grid_values(grid);
+
+  struct solver solver;
+  init_solver(&solver, grid);
+  solver.random = random;
+
+  // The empty grid always has a solution.
+  (void)search(&solver, NULL);
+
+  uint8_t order[NUMBER_OF_SQUARES];
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    puzzle[i] = (char)('1' + __builtin_ctz(solver.grid[i]));
+    order[i] = (uint8_t)i;
+  }
+
+  puzzle[NUMBER_OF_SQUARES] = '\0';
+
+  for (int i = NUMBER_OF_SQUARES - 1; i > 0; --i) {
+    const int j = (int)(next_random(random) % (uint64_t)(i + 1));
+    const uint8_t square = order[i];
+    order[i] = order[j];
+    order[j] = square;
+  }
+
+  int clues = NUMBER_OF_SQUARES;
+
+  for (int i = 0; i < NUMBER_OF_SQUARES && clues > target_clues; ++i) {
+    const int square = order[i];
+    const char value = puzzle[square];
+
+    puzzle[square] = '.';
+
+    if (has_other_solution(puzzle, square, solver.grid[square])) {
+      puzzle[square] = value;
+    }
+    else {
+      --clues;
+    }
+  }
+
+  return clues;
+}
+
+// Generates puzzle number index of the run with the given seed, keeping the
+// attempt with the fewest clues if none reaches target_clues.
+static int generate_puzzle(uint64_t seed, uint64_t index, int target_clues, char puzzle[82]) {
+  uint64_t random = index;
+  random = seed ^ next_random(&random);
+
+  int best = NUMBER_OF_SQUARES + 1;
+
+  for (int attempt = 0; attempt < GENERATOR_ATTEMPTS && best > target_clues; ++attempt) {
+    char candidate[82];
+    const int clues = generate_from_grid(&random, target_clues, candidate);
+
+    if (clues < best) {
+      best = clues;
+      memcpy(puzzle, candidate, sizeof(candidate));
+    }
+
+    // Without a target one minimal puzzle is enough.
+    if (target_clues == 0) {
+      break;
+    }
+  }
+
+  return best;
+}
+
+struct generator {
+  uint64_t seed;
+  int target_clues;
+  uint64_t first;
+  int count;
+  atomic_int next;
+  // Each puzzle followed by a newline, ready to write.
+  char (*lines)[NUMBER_OF_SQUARES + 1];
+};
+
+static void *generator_worker(void *arg) {
+  struct generator *generator = arg;
+  int i;
+
+  while ((i = atomic_fetch_add_explicit(&generator->next, 1, memory_order_relaxed)) < generator->count) {
+    char puzzle[82];
+
+    (void)generate_puzzle(generator->seed, generator->first + (uint64_t)i, generator->target_clues, puzzle);
+    memcpy(generator->lines[i], puzzle, NUMBER_OF_SQUARES);
+    generator->lines[i][NUMBER_OF_SQUARES] = '\n';
+  }
+
+  return NULL;
+}
+
+// Writes count unique puzzles to stdout, generated in rounds by
+// thread_count threads.
+static _Bool generate_puzzles(long count, int target_clues, uint64_t seed, int thread_count) {
+  const int round_size = PUZZLES_PER_ROUND * thread_count;
+  struct generator generator = { .seed = seed, .target_clues = target_clues };
+
+  generator.lines = malloc(sizeof(*generator.lines) * (size_t)round_size);
+
+  if (generator.lines == NULL) {
+    perror("generate_puzzles");
+    return false;
+  }
+
+  pthread_t threads[thread_count];
+  _Bool ok = true;
+
+  for (long first = 0; first < count && ok; first += round_size) {
+    generator.first = (uint64_t)first;
+    generator.count = count - first < round_size ? (int)(count - first) : round_size;
+    atomic_init(&generator.next, 0);
+
+    int started = 0;
+
+    while (started < thread_count - 1 &&
+	   pthread_create(&threads[started], NULL, generator_worker, &generator) == 0) {
+      ++started;
+    }
+
+    generator_worker(&generator);
+
+    for (int i = 0; i < started; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+
+    ok = write_all(STDOUT_FILENO, generator.lines[0], sizeof(*generator.lines) * (size_t)generator.count);
+  }
+
+  free(generator.lines);
+
+  return ok;
+}
+
+/*
+
+  Server
+
+  --serve keeps the solver resident and answers over a Unix domain socket,
+  or over TCP on localhost when the address is a port number. The protocol
+  is the batch format: every line sent gets its answer line back, in order,
+  and a line reading "stats" gets a line of server stats instead.
+
+  Each connection has a reader thread that cuts what arrives into jobs of
+  up to SERVER_JOB_LINES lines. A fixed pool of solver threads takes the
+  jobs from one queue shared by all connections, so puzzles pipelined on
+  one connection are batched the same way as puzzles from many. Each
+  connection also has a writer thread, which writes its finished jobs in
+  order, so a client that does not read its answers only holds up itself.
+  Its reader stops taking input while SERVER_QUEUE_LINES of its lines are
+  not written yet.
+
+  On SIGINT or SIGTERM the server stops reading from its clients, answers
+  every line it has read, and then stops the solver threads. Clients that
+  do not take their answers within SERVER_DRAIN_SECONDS are cut off.
+
+ */
+
+#define SERVER_JOB_LINES 64
+// Readers wait while this many lines per solver thread are queued, which
+// leaves unread input to push back on clients that send faster than the
+// server solves.
+#define SERVER_QUEUE_LINES 1024
+#define SERVER_READ_SIZE (1 << 16)
+#define SERVER_STATS_SIZE 320
+#define SERVER_DRAIN_SECONDS 5
+#define LATENCY_BUCKETS 32
+
+struct server_connection;
+
+struct server_job {
+  struct server_job *next_in_queue;
+  struct server_job *next_in_connection;
+  struct server_connection *connection;
+  double queued_at;
+  int lines;
+  _Bool stats;
+  _Bool done;
+  char *input;
+  size_t input_size;
+  char *output;
+  size_t output_size;
+};
+
+struct server_connection {
+  int fd;
+  pthread_mutex_t mutex;
+  // Broadcast when a job is finished or written, and when reading ends.
+  pthread_cond_t changed;
+  // Jobs not written yet, oldest first.
+  struct server_job *first;
+  struct server_job *last;
+  long unwritten_lines;
+  _Bool reading_done;
+  pthread_t writer;
+  // In the server's list of connections.
+  struct server_connection *next;
+  struct server_connection *previous;
+};
+
+struct server {
+  const struct solve_options *options;
+  pthread_mutex_t mutex;
+  pthread_cond_t work_ready;
+  pthread_cond_t space_ready;
+  struct server_job *first;
+  struct server_job *last;
+  // Lines waiting for a solver thread.
+  long queued;
+  long queue_limit;
+  long max_queued;
+  long connections;
+  struct server_connection *connection_list;
+  pthread_cond_t connection_closed;
+  // Solver threads stop once this is set and the queue is empty.
+  _Bool stopping;
+  atomic_long requests;
+  // Answered lines by the bit length of their latency in microseconds,
+  // from the read that brought them in to the write of their answer.
+  atomic_long latencies[LATENCY_BUCKETS];
+  atomic_long max_latency;
+};
+
+static struct server server = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .work_ready = PTHREAD_COND_INITIALIZER,
+  .space_ready = PTHREAD_COND_INITIALIZER,
+  .connection_closed = PTHREAD_COND_INITIALIZER,
+};
+
+static volatile sig_atomic_t server_stopping;
+
+static void stop_server(int signal_number) {
+  (void)signal_number;
+  server_stopping = 1;
+}
+
+// Starts a thread with SIGINT and SIGTERM blocked, so they always reach the
+// thread that accepts connections.
+static _Bool start_server_thread(pthread_t *thread, void *(*main)(void *), void *arg) {
+  sigset_t signals;
+  sigset_t previous;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+  const int result = pthread_create(thread, NULL, main, arg);
+
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  if (result != 0) {
+    errno = result;
+    perror("pthread_create");
+  }
+
+  return result == 0;
+}
+
+static void record_latency(const struct server_job *job) {
+  const long microseconds = (long)((monotonic_seconds() - job->queued_at) * 1e6);
+  int bucket = microseconds > 0 ? 64 - __builtin_clzll((unsigned long long)microseconds) : 0;
+
+  if (bucket >= LATENCY_BUCKETS) {
+    bucket = LATENCY_BUCKETS - 1;
+  }
+
+  atomic_fetch_add_explicit(&server.latencies[bucket], job->lines, memory_order_relaxed);
+
+  long max = atomic_load_explicit(&server.max_latency, memory_order_relaxed);
+
+  while (microseconds > max &&
+	 !atomic_compare_exchange_weak_explicit(&server.max_latency, &max, microseconds,
+						memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+// The upper end of the bucket holding the given percentile of latencies.
+static long latency_percentile(const long counts[LATENCY_BUCKETS], long total, int percent) {
+  long seen = 0;
+
+  for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+    seen += counts[i];
+
+    if (seen * 100 >= total * percent && seen > 0) {
+      return 1L << i;
+    }
+  }
+
+  return 0;
+}
+
+static char *format_server_stats(char *dest) {
+  long counts[LATENCY_BUCKETS];
+  long total = 0;
+
+  for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+    counts[i] = atomic_load_explicit(&server.latencies[i], memory_order_relaxed);
+    total += counts[i];
+  }
+
+  pthread_mutex_lock(&server.mutex);
+  const long queued = server.queued;
+  const long max_queued = server.max_queued;
+  const long connections = server.connections;
+  pthread_mutex_unlock(&server.mutex);
+
+  return dest + sprintf(dest, "connections %ld queued %ld max_queued %ld requests %ld timed_out %ld "
+			"p50_us %ld p90_us %ld p99_us %ld max_us %ld\n",
+			connections, queued, max_queued,
+			atomic_load_explicit(&server.requests, memory_order_relaxed),
+			atomic_load_explicit(&timed_out_count, memory_order_relaxed),
+			latency_percentile(counts, total, 50), latency_percentile(counts, total, 90),
+			latency_percentile(counts, total, 99),
+			atomic_load_explicit(&server.max_latency, memory_order_relaxed));
+}
+
+// Copies the lines in [begin, end), each ending in a newline, into a new
+// job, and queues it behind the connection's other jobs.
+static _Bool queue_job(struct server_connection *connection, const char *begin, const char *end,
+		       int lines, _Bool stats) {
+  const size_t input_size = (size_t)(end - begin);
+  const size_t output_size = input_size + (size_t)lines + (stats ? SERVER_STATS_SIZE : 0);
+  struct server_job *job = malloc(sizeof(*job) + input_size + output_size);
+
+  if (job == NULL) {
+    perror("malloc");
+    return false;
+  }
+
+  *job = (struct server_job){
+    .connection = connection,
+    .queued_at = monotonic_seconds(),
+    .lines = lines,
+    .stats = stats,
+    .input = (char *)(job + 1),
+    .input_size = input_size,
+  };
+  job->output = job->input + input_size;
+  memcpy(job->input, begin, input_size);
+
+  pthread_mutex_lock(&connection->mutex);
+
+  while (connection->unwritten_lines >= SERVER_QUEUE_LINES) {
+    pthread_cond_wait(&connection->changed, &connection->mutex);
+  }
+
+  connection->unwritten_lines += lines;
+
+  if (connection->last != NULL) {
+    connection->last->next_in_connection = job;
+  }
+  else {
+    connection->first = job;
+  }
+
+  connection->last = job;
+  pthread_mutex_unlock(&connection->mutex);
+
+  pthread_mutex_lock(&server.mutex);
+
+  while (server.queued >= server.queue_limit) {
+    pthread_cond_wait(&server.space_ready, &server.mutex);
+  }
+
+  if (server.last != NULL) {
+    server.last->next_in_queue = job;
+  }
+  else {
+    server.first = job;
+  }
+
+  server.last = job;
+  server.queued += lines;
+  server.max_queued = server.queued > server.max_queued ? server.queued : server.max_queued;
+  pthread_cond_signal(&server.work_ready);
+  pthread_mutex_unlock(&server.mutex);
+
+  return true;
+}
+
+static _Bool is_stats_line(const char *line, size_t length) {
+  if (length > 0 && line[length - 1] == '\r') {
+    --length;
+  }
+
+  return length == 5 && memcmp(line, "stats", 5) == 0;
+}
+
+// Queues the complete lines in [begin, end) as jobs, with each stats line
+// in a job of its own. Returns a pointer to the trailing partial line, or
+// NULL if a job could not be queued.
+static const char *queue_lines(struct server_connection *connection, const char *begin, const char *end) {
+  const char *job_begin = begin;
+  int lines = 0;
+
+  while (begin < end) {
+    const char *newline = memchr(begin, '\n', (size_t)(end - begin));
+
+    if (newline == NULL) {
+      break;
+    }
+
+    if (is_stats_line(begin, (size_t)(newline - begin))) {
+      if ((lines > 0 && !queue_job(connection, job_begin, begin, lines, false)) ||
+	  !queue_job(connection, begin, newline + 1, 1, true)) {
+	return NULL;
+      }
+
+      lines = 0;
+      job_begin = newline + 1;
+    }
+    else if (++lines == SERVER_JOB_LINES) {
+      if (!queue_job(connection, job_begin, newline + 1, lines, false)) {
+	return NULL;
+      }
+
+      lines = 0;
+      job_begin = newline + 1;
+    }
+
+    begin = newline + 1;
+  }
+
+  if (lines > 0 && !queue_job(connection, job_begin, begin, lines, false)) {
+    return NULL;
+  }
+
+  return begin;
+}
+
+static void solve_job(struct server_job *job) {
+  if (job->stats) {
+    job->output_size = (size_t)(format_server_stats(job->output) - job->output);
+    return;
+  }
+
+  const char *begin = job->input;
+  const char *end = job->input + job->input_size;
+  char *dest = job->output;
+
+  while (begin < end) {
+    const char *newline = memchr(begin, '\n', (size_t)(end - begin));
+
+    dest = format_solution(server.options, begin, (size_t)(newline - begin), dest);
+    begin = newline + 1;
+  }
+
+  job->output_size = (size_t)(dest - job->output);
+  atomic_fetch_add_explicit(&server.requests, job->lines, memory_order_relaxed);
+}
+
+static void finish_job(struct server_job *job) {
+  struct server_connection *connection = job->connection;
+
+  pthread_mutex_lock(&connection->mutex);
+  job->done = true;
+  pthread_cond_broadcast(&connection->changed);
+  pthread_mutex_unlock(&connection->mutex);
+}
+
+static void *server_worker(void *arg) {
+  (void)arg;
+
+  for (;;) {
+    pthread_mutex_lock(&server.mutex);
+
+    while (server.first == NULL && !server.stopping) {
+      pthread_cond_wait(&server.work_ready, &server.mutex);
+    }
+
+    struct server_job *job = server.first;
+
+    if (job == NULL) {
+      pthread_mutex_unlock(&server.mutex);
+      break;
+    }
+
+    server.first = job->next_in_queue;
+
+    if (server.first == NULL) {
+      server.last = NULL;
+    }
+
+    server.queued -= job->lines;
+    pthread_cond_broadcast(&server.space_ready);
+    pthread_mutex_unlock(&server.mutex);
+
+    solve_job(job);
+    finish_job(job);
+  }
+
+  return NULL;
+}
+
+// Writes the finished jobs at the front of the connection as they come,
+// until the reader is done and every job is written. Write errors only
+// mean the client went away; the reader sees that too and stops, and the
+// jobs left are dropped.
+static void *connection_writer(void *arg) {
+  struct server_connection *connection = arg;
+  _Bool writable = true;
+
+  pthread_mutex_lock(&connection->mutex);
+
+  for (;;) {
+    while (!(connection->first != NULL && connection->first->done) &&
+	   !(connection->first == NULL && connection->reading_done)) {
+      pthread_cond_wait(&connection->changed, &connection->mutex);
+    }
+
+    if (connection->first == NULL) {
+      break;
+    }
+
+    // Nothing else touches finished jobs, so they are written unlocked.
+    struct server_job *job = connection->first;
+    struct server_job *unfinished = job;
+
+    while (unfinished != NULL && unfinished->done) {
+      unfinished = unfinished->next_in_connection;
+    }
+
+    connection->first = unfinished;
+
+    if (unfinished == NULL) {
+      connection->last = NULL;
+    }
+
+    pthread_mutex_unlock(&connection->mutex);
+
+    long lines = 0;
+
+    while (job != unfinished) {
+      struct server_job *next = job->next_in_connection;
+
+      writable = writable && write_all(connection->fd, job->output, job->output_size);
+      record_latency(job);
+      lines += job->lines;
+      free(job);
+      job = next;
+    }
+
+    pthread_mutex_lock(&connection->mutex);
+    connection->unwritten_lines -= lines;
+    pthread_cond_broadcast(&connection->changed);
+  }
+
+  pthread_mutex_unlock(&connection->mutex);
+
+  return NULL;
+}
+
+static void *connection_main(void *arg) {
+  static const char empty_line[] = "\n";
+  struct server_connection *connection = arg;
+  char *buffer = malloc(SERVER_READ_SIZE);
+  size_t pending = 0;
+  _Bool skipping = false;
+  _Bool ok = buffer != NULL;
+  const _Bool writing = start_server_thread(&connection->writer, connection_writer, connection);
+
+  ok = ok && writing;
+
+  while (ok) {
+    const ssize_t result = read(connection->fd, buffer + pending, SERVER_READ_SIZE - pending);
+
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (result <= 0) {
+      break;
+    }
+
+    const char *begin = buffer;
+    const char *end = buffer + pending + (size_t)result;
+
+    if (skipping) {
+      // Discard the remainder of an overlong line.
+      const char *newline = memchr(begin, '\n', (size_t)(end - begin));
+
+      if (newline == NULL) {
+	pending = 0;
+	continue;
+      }
+
+      skipping = false;
+      begin = newline + 1;
+    }
+
+    const char *rest = queue_lines(connection, begin, end);
+
+    if (rest == NULL) {
+      ok = false;
+      break;
+    }
+
+    pending = (size_t)(end - rest);
+
+    if (pending == SERVER_READ_SIZE) {
+      ok = queue_job(connection, empty_line, empty_line + 1, 1, false);
+      pending = 0;
+      skipping = true;
+    }
+    else {
+      memmove(buffer, rest, pending);
+    }
+  }
+
+  // A last line without a newline is still a request.
+  if (ok && pending > 0 && !skipping) {
+    buffer[pending++] = '\n';
+    (void)queue_lines(connection, buffer, buffer + pending);
+  }
+
+  pthread_mutex_lock(&connection->mutex);
+  connection->reading_done = true;
+  pthread_cond_broadcast(&connection->changed);
+  pthread_mutex_unlock(&connection->mutex);
+
+  if (writing) {
+    pthread_join(connection->writer, NULL);
+  }
+
+  pthread_mutex_lock(&server.mutex);
+
+  if (connection->previous != NULL) {
+    connection->previous->next = connection->next;
+  }
+  else {
+    server.connection_list = connection->next;
+  }
+
+  if (connection->next != NULL) {
+    connection->next->previous = connection->previous;
+  }
+
+  --server.connections;
+  pthread_cond_broadcast(&server.connection_closed);
+  pthread_mutex_unlock(&server.mutex);
+
+  close(connection->fd);
+  pthread_mutex_destroy(&connection->mutex);
+  pthread_cond_destroy(&connection->changed);
+  free(connection);
+  free(buffer);
+
+  return NULL;
+}
+
+// Listens on address, a port number for TCP on localhost or else the path
+// of a Unix domain socket. Returns the socket, or -1.
+static int listen_on(const char *address) {
+  const _Bool tcp = address[0] != '\0' && strspn(address, "0123456789") == strlen(address);
+  const int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  int bound;
+
+  if (tcp) {
+    const int yes = 1;
+    struct sockaddr_in name = {
+      .sin_family = AF_INET,
+      .sin_port = htons((uint16_t)atoi(address)),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    bound = bind(fd, (const struct sockaddr *)&name, sizeof(name));
+  }
+  else {
+    struct sockaddr_un name = { .sun_family = AF_UNIX };
+    struct stat info;
+
+    if (strlen(address) >= sizeof(name.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", address);
+      close(fd);
+      return -1;
+    }
+
+    // A socket left behind by an earlier server.
+    if (stat(address, &info) == 0 && S_ISSOCK(info.st_mode)) {
+      unlink(address);
+    }
+
+    strcpy(name.sun_path, address);
+    bound = bind(fd, (const struct sockaddr *)&name, sizeof(name));
+  }
+
+  if (bound < 0 || listen(fd, SOMAXCONN) < 0) {
+    perror(address);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Serves until SIGINT or SIGTERM, with thread_count solver threads.
+static _Bool serve(const char *address, int thread_count, const struct solve_options *options) {
+  const int fd = listen_on(address);
+
+  if (fd < 0) {
+    return false;
+  }
+
+  server.options = options;
+  server.queue_limit = (long)thread_count * SERVER_QUEUE_LINES;
+
+  struct sigaction stop = { .sa_handler = stop_server };
+  sigemptyset(&stop.sa_mask);
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_t workers[thread_count];
+  int started = 0;
+
+  while (started < thread_count && start_server_thread(&workers[started], server_worker, NULL)) {
+    ++started;
+  }
+
+  if (started < thread_count) {
+    server_stopping = 1;
+  }
+
+  fprintf(stderr, "Serving on %s with %d threads\n", address, thread_count);
+
+  while (!server_stopping) {
+    const int client = accept(fd, NULL, NULL);
+
+    if (client < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+	perror("accept");
+      }
+
+      continue;
+    }
+
+    struct server_connection *connection = malloc(sizeof(*connection));
+    pthread_t thread;
+
+    if (connection == NULL) {
+      close(client);
+      continue;
+    }
+
+    *connection = (struct server_connection){ .fd = client };
+    pthread_mutex_init(&connection->mutex, NULL);
+    pthread_cond_init(&connection->changed, NULL);
+
+    pthread_mutex_lock(&server.mutex);
+
+    if (!start_server_thread(&thread, connection_main, connection)) {
+      pthread_mutex_unlock(&server.mutex);
+      close(client);
+      free(connection);
+      continue;
+    }
+
+    // The thread cannot leave the list before it takes the server mutex.
+    connection->next = server.connection_list;
+
+    if (server.connection_list != NULL) {
+      server.connection_list->previous = connection;
+    }
+
+    server.connection_list = connection;
+    ++server.connections;
+    pthread_mutex_unlock(&server.mutex);
+
+    pthread_detach(thread);
+  }
+
+  close(fd);
+
+  if (strspn(address, "0123456789") != strlen(address)) {
+    unlink(address);
+  }
+
+  // Readers see the end of their input and wait for their answers to be
+  // written, and clients that do not take them are cut off.
+  pthread_mutex_lock(&server.mutex);
+
+  for (struct server_connection *connection = server.connection_list; connection != NULL;
+       connection = connection->next) {
+    shutdown(connection->fd, SHUT_RD);
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += SERVER_DRAIN_SECONDS;
+
+  while (server.connections > 0) {
+    if (pthread_cond_timedwait(&server.connection_closed, &server.mutex, &deadline) == ETIMEDOUT) {
+      for (struct server_connection *connection = server.connection_list; connection != NULL;
+	   connection = connection->next) {
+	shutdown(connection->fd, SHUT_RDWR);
+      }
+
+      deadline.tv_sec += SERVER_DRAIN_SECONDS;
+    }
+  }
+
+  server.stopping = true;
+  pthread_cond_broadcast(&server.work_ready);
+  pthread_mutex_unlock(&server.mutex);
+
+  for (int i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+
+  char stats[SERVER_STATS_SIZE];
+  format_server_stats(stats);
+  fprintf(stderr, "%s", stats);
+
+  return started == thread_count;
+}
+
+/*
+
+  Coordinator
+
+  --workers N solves a file with N worker processes instead of threads. The
+  file is cut into shards on line boundaries, COORDINATOR_SHARDS_PER_WORKER
+  per worker, and each worker runs this binary on one shard at a time. A
+  worker takes its shard on stdin and answers on stdout in the batch
+  format, so all it needs is a pair of pipes: --worker-command runs workers
+  through a shell command instead, such as ssh to another host, which gets
+  the same arguments and the same shard bytes, and behaves the same.
+
+  A worker that fails to start, exits with an error or answers the wrong
+  number of lines is replaced, and its shard is retried up to
+  COORDINATOR_ATTEMPTS times in all. Shards are written out in input order
+  as soon as every shard before them is done.
+
+ */
+
+#define COORDINATOR_SHARDS_PER_WORKER 4
+#define COORDINATOR_ATTEMPTS 3
+#define WORKER_ARGUMENTS 24
+
+struct shard {
+  const char *input;
+  size_t input_size;
+  long lines;
+  char *output;
+  size_t output_size;
+  _Bool done;
+  _Bool solved;
+};
+
+struct coordinator {
+  const char *program;
+  char *arguments[WORKER_ARGUMENTS];
+  char numbers[3][32];
+  char *script;
+  struct shard *shards;
+  int shard_count;
+  atomic_int next_shard;
+  atomic_bool stopped;
+  atomic_long retries;
+  // Held from creating a worker's pipes until they are close on exec, so
+  // no other worker inherits them.
+  pthread_mutex_t spawn_lock;
+  pthread_mutex_t mutex;
+  pthread_cond_t shard_done;
+};
+
+static long count_lines(const char *data, size_t size) {
+  long lines = 0;
+
+  for (const char *newline = data; (newline = memchr(newline, '\n', size - (size_t)(newline - data))) != NULL;
+       ++newline) {
+    ++lines;
+  }
+
+  return lines + (size > 0 && data[size - 1] != '\n');
+}
+
+// Fills in the command line that makes a worker solve a shard from stdin
+// the way options ask.
+static _Bool set_worker_arguments(struct coordinator *coordinator, const char *worker_command,
+				  const struct solve_options *options) {
+  char **argument = coordinator->arguments;
+
+  if (worker_command == NULL) {
+    coordinator->program = "/proc/self/exe";
+    *argument++ = "sudoku";
+  }
+  else {
+    coordinator->script = malloc(strlen(worker_command) + sizeof(" \"$@\""));
+
+    if (coordinator->script == NULL) {
+      return false;
+    }
+
+    sprintf(coordinator->script, "%s \"$@\"", worker_command);
+    coordinator->program = "/bin/sh";
+    *argument++ = "sh";
+    *argument++ = "-c";
+    *argument++ = coordinator->script;
+    *argument++ = "sh";
+  }
+
+  *argument++ = "--engine";
+  *argument++ = (char *)options->engine->name;
+  *argument++ = "--propagation";
+  *argument++ = (char *)PROPAGATION_NAMES[propagation];
+  *argument++ = "--value-order";
+  *argument++ = (char *)VALUE_ORDER_NAMES[value_order];
+  *argument++ = "--branching";
+  *argument++ = (char *)BRANCHING_NAMES[branching];
+
+  if (options->solution_limit > 0) {
+    sprintf(coordinator->numbers[0], "%d", options->solution_limit);
+    *argument++ = "--count-solutions";
+    *argument++ = coordinator->numbers[0];
+  }
+
+  if (options->node_budget > 0) {
+    sprintf(coordinator->numbers[1], "%llu", (unsigned long long)options->node_budget);
+    *argument++ = "--node-budget";
+    *argument++ = coordinator->numbers[1];
+  }
+
+  if (options->deadline_seconds > 0) {
+    sprintf(coordinator->numbers[2], "%.3f", options->deadline_seconds * 1e6);
+    *argument++ = "--deadline-us";
+    *argument++ = coordinator->numbers[2];
+  }
+
+  *argument++ = "-";
+  *argument = NULL;
+
+  return true;
+}
+
+// Starts a worker with its stdin and stdout on new pipes, returning its
+// pid, or -1 if it could not be started.
+static pid_t start_worker(struct coordinator *coordinator, int *input_fd, int *output_fd) {
+  int input[2];
+  int output[2];
+
+  pthread_mutex_lock(&coordinator->spawn_lock);
+
+  if (pipe(input) != 0) {
+    perror("pipe");
+    pthread_mutex_unlock(&coordinator->spawn_lock);
+    return -1;
+  }
+
+  if (pipe(output) != 0) {
+    perror("pipe");
+    close(input[0]);
+    close(input[1]);
+    pthread_mutex_unlock(&coordinator->spawn_lock);
+    return -1;
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    (void)fcntl(input[i], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(output[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  const pid_t pid = fork();
+
+  if (pid == 0) {
+    // dup2 clears close on exec on the copies.
+    if (dup2(input[0], STDIN_FILENO) >= 0 && dup2(output[1], STDOUT_FILENO) >= 0) {
+      execv(coordinator->program, coordinator->arguments);
+    }
+
+    _exit(127);
+  }
+
+  pthread_mutex_unlock(&coordinator->spawn_lock);
+
+  close(input[0]);
+  close(output[1]);
+
+  if (pid < 0) {
+    perror("fork");
+    close(input[1]);
+    close(output[0]);
+    return -1;
+  }
+
+  *input_fd = input[1];
+  *output_fd = output[0];
+
+  return pid;
+}
+
+// Runs a worker on shard, feeding it the shard while collecting its answer.
+// Returns whether it exited cleanly with a line for every line of input.
+static _Bool run_worker(struct coordinator *coordinator, struct shard *shard) {
+  int input;
+  int output;
+  const pid_t pid = start_worker(coordinator, &input, &output);
+
+  if (pid < 0) {
+    return false;
+  }
+
+  (void)fcntl(input, F_SETFL, O_NONBLOCK);
+
+  size_t written = 0;
+  size_t capacity = shard->input_size + (size_t)shard->lines + 1;
+  _Bool ok = true;
+
+  shard->output = malloc(capacity);
+  shard->output_size = 0;
+
+  if (shard->output == NULL || shard->input_size == 0) {
+    ok = shard->output != NULL;
+    close(input);
+    input = -1;
+  }
+
+  while (ok) {
+    struct pollfd fds[2] = { { output, POLLIN, 0 }, { input, POLLOUT, 0 } };
+
+    if (poll(fds, input >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+
+      perror("poll");
+      ok = false;
+      break;
+    }
+
+    if (input >= 0 && fds[1].revents != 0) {
+      const ssize_t result = write(input, shard->input + written, shard->input_size - written);
+
+      // A worker that stops reading has failed, which its exit shows.
+      if (result < 0 && errno != EAGAIN && errno != EINTR) {
+	written = shard->input_size;
+      }
+      else if (result > 0) {
+	written += (size_t)result;
+      }
+
+      if (written == shard->input_size) {
+	close(input);
+	input = -1;
+      }
+    }
+
+    if (fds[0].revents == 0) {
+      continue;
+    }
+
+    if (shard->output_size == capacity) {
+      char *grown = realloc(shard->output, capacity * 2);
+
+      if (grown == NULL) {
+	ok = false;
+	break;
+      }
+
+      shard->output = grown;
+      capacity *= 2;
+    }
+
+    const ssize_t result = read(output, shard->output + shard->output_size, capacity - shard->output_size);
+
+    if (result == 0) {
+      break;
+    }
+
+    if (result < 0 && errno != EINTR) {
+      perror("read");
+      ok = false;
+    }
+    else if (result > 0) {
+      shard->output_size += (size_t)result;
+    }
+  }
+
+  if (input >= 0) {
+    close(input);
+  }
+
+  close(output);
+
+  if (!ok) {
+    kill(pid, SIGKILL);
+  }
+
+  int status = 0;
+
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+    count_lines(shard->output, shard->output_size) == shard->lines;
+}
+
+static void *coordinator_thread(void *arg) {
+  struct coordinator *coordinator = arg;
+  int index;
+
+  while (!atomic_load(&coordinator->stopped) &&
+	 (index = atomic_fetch_add(&coordinator->next_shard, 1)) < coordinator->shard_count) {
+    struct shard *shard = &coordinator->shards[index];
+    _Bool solved = false;
+
+    for (int attempt = 1; attempt <= COORDINATOR_ATTEMPTS && !solved; ++attempt) {
+      solved = run_worker(coordinator, shard);
+
+      if (!solved) {
+	free(shard->output);
+	shard->output = NULL;
+
+	if (attempt < COORDINATOR_ATTEMPTS) {
+	  fprintf(stderr, "Worker failed on shard %d, retrying\n", index);
+	  atomic_fetch_add(&coordinator->retries, 1);
+	}
+      }
+    }
+
+    pthread_mutex_lock(&coordinator->mutex);
+    shard->solved = solved;
+    shard->done = true;
+    pthread_cond_broadcast(&coordinator->shard_done);
+    pthread_mutex_unlock(&coordinator->mutex);
+  }
+
+  return NULL;
+}
+
+// Cuts data into at most count shards that end on line boundaries,
+// returning how many it made.
+static int cut_shards(const char *data, size_t size, int count, struct shard *shards) {
+  const char *begin = data;
+  const char *end = data + size;
+  int made = 0;
+
+  for (int i = 1; i <= count && begin < end; ++i) {
+    const char *cut = i == count ? end : data + (size_t)((double)size * i / count);
+
+    // The line before cut already went into the last shard.
+    if (cut <= begin) {
+      continue;
+    }
+
+    const char *newline = memchr(cut - 1, '\n', (size_t)(end - cut + 1));
+    const char *stop = newline == NULL ? end : newline + 1;
+
+    shards[made++] = (struct shard){
+      .input = begin,
+      .input_size = (size_t)(stop - begin),
+      .lines = count_lines(begin, (size_t)(stop - begin)),
+    };
+    begin = stop;
+  }
+
+  return made;
+}
+
+static void count_answers(const struct shard *shard, struct coordinator_stats *stats) {
+  const char *line = shard->output;
+  const char *end = shard->output + shard->output_size;
+
+  while (line < end) {
+    const char *newline = memchr(line, '\n', (size_t)(end - line));
+    const size_t length = (size_t)((newline != NULL ? newline : end) - line);
+
+    stats->empty += length == 0;
+    stats->timed_out += memchr(line, '.', length) != NULL;
+    line += length + 1;
+  }
+
+  stats->lines += shard->lines;
+}
+
+// Solves the puzzles in path with worker processes, writing the solutions
+// to out_fd in order, and adds up what they answered in stats.
+static _Bool coordinate(const char *path, int out_fd, int worker_count, const char *worker_command,
+			const struct solve_options *options, struct coordinator_stats *stats) {
+  *stats = (struct coordinator_stats){ 0 };
+
+  const int fd = open(path, O_RDONLY);
+  struct stat info;
+
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    fprintf(stderr, "--workers needs a regular file: %s\n", path);
+    close(fd);
+    return false;
+  }
+
+  const size_t size = (size_t)info.st_size;
+  char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  uint64_t count;
+
+  if (unpack_header(data, size, &count)) {
+    fprintf(stderr, "--workers takes puzzles as text\n");
+    munmap(data, size);
+    return false;
+  }
+
+  // Writing to a worker that died must fail rather than end the process.
+  signal(SIGPIPE, SIG_IGN);
+
+  struct coordinator coordinator = {
+    .spawn_lock = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .shard_done = PTHREAD_COND_INITIALIZER,
+  };
+
+  const int shard_limit = worker_count * COORDINATOR_SHARDS_PER_WORKER;
+
+  coordinator.shards = calloc((size_t)shard_limit, sizeof(struct shard));
+
+  if (coordinator.shards == NULL || !set_worker_arguments(&coordinator, worker_command, options)) {
+    free(coordinator.shards);
+    if (data != NULL) {
+      munmap(data, size);
+    }
+    return false;
+  }
+
+  coordinator.shard_count = data != NULL ? cut_shards(data, size, shard_limit, coordinator.shards) : 0;
+
+  pthread_t threads[worker_count];
+  int started = 0;
+
+  while (started < worker_count && started < coordinator.shard_count &&
+	 pthread_create(&threads[started], NULL, coordinator_thread, &coordinator) == 0) {
+    ++started;
+  }
+
+  _Bool ok = started > 0 || coordinator.shard_count == 0;
+
+  for (int i = 0; ok && i < coordinator.shard_count; ++i) {
+    struct shard *shard = &coordinator.shards[i];
+
+    pthread_mutex_lock(&coordinator.mutex);
+
+    while (!shard->done) {
+      pthread_cond_wait(&coordinator.shard_done, &coordinator.mutex);
+    }
+
+    pthread_mutex_unlock(&coordinator.mutex);
+
+    if (!shard->solved) {
+      fprintf(stderr, "Shard %d failed %d times\n", i, COORDINATOR_ATTEMPTS);
+      ok = false;
+      break;
+    }
+
+    ok = write_all(out_fd, shard->output, shard->output_size);
+    count_answers(shard, stats);
+    ++stats->shards;
+  }
+
+  atomic_store(&coordinator.stopped, true);
+
+  for (int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < coordinator.shard_count; ++i) {
+    free(coordinator.shards[i].output);
+  }
+
+  stats->retries = atomic_load(&coordinator.retries);
+
+  free(coordinator.shards);
+  free(coordinator.script);
+
+  if (data != NULL) {
+    munmap(data, size);
+  }
+
+  return ok;
+}
+
+/*
+
+  Logic Tests
+
+ */
+
+static void test_can_eliminate_value_from_peers() {
+  struct solver solver = { .trail_size = 0 };
+  uint16_t *grid = solver.grid;
+  default_grid_values(grid);
+
+  const uint16_t known_value = 0x08;
+  const int square = 0;
+
+  grid[square] = known_value;
+
+  assert(eliminate_from_peers(&solver, square, known_value));
+  assert(grid[square] == known_value);
+
+  for (int i = 1; i < NUMBER_OF_SQUARES; ++i) {
+    if ((i > 0 && i < 12) || (i > 17 && i < 21) ||
+	i == 27 || i == 36 || i == 45 ||
+	i == 54 || i == 63 || i == 72) {
+      assert(grid[i] == 0x1F7);
+    }
+    else {
+      assert(grid[i] == 0x1FF);
+    }
+  }
+}
+
+static void test_eliminate_only_modifies_peers_with_values_to_remove() {
+  struct solver solver = { .trail_size = 0 };
+  uint16_t *grid = solver.grid;
+  default_grid_values(grid);
+
+  const uint16_t known_value = 0x01;
+  const uint16_t peer_value = 0x02;
+  const int square = 0;
+  const int peer = 4;
+
+  grid[square] = known_value;
+  grid[peer] = peer_value;
+
+  assert(eliminate_from_peers(&solver, square, known_value));
+  assert(grid[square] == known_value);
+  assert(grid[peer] == peer_value);
+}
+
+
+static void test_eliminate_cascades_through_new_singles() {
+  struct solver solver = { .trail_size = 0 };
+  uint16_t *grid = solver.grid;
+  default_grid_values(grid);
+
+  grid[1] = 0x03;
+  grid[2] = 0x06;
+  grid[3] = 0x0C;
+
+  assert(eliminate_from_peers(&solver, 0, 0x01));
+  assert(grid[1] == 0x02);
+  assert(grid[2] == 0x04);
+  assert(grid[3] == 0x08);
+  assert(grid[80] == 0x1FF);
+  assert(grid[4] == 0x1F0);
+}
+
+static void test_eliminate_fails_when_a_square_runs_out_of_values() {
+  struct solver solver = { .trail_size = 0 };
+  uint16_t *grid = solver.grid;
+  default_grid_values(grid);
+
+  grid[1] = 0x03;
+  grid[2] = 0x02;
+
+  assert(!eliminate_from_peers(&solver, 0, 0x01));
+}
+
+static void test_places_hidden_single() {
+  struct solver solver = { .trail_size = 0 };
+  uint16_t *grid = solver.grid;
+  default_grid_values(grid);
+
+  for (int i = 1; i < 9; ++i) {
+    grid[i] &= ~0x01;
+  }
+
+  assert(place_hidden_singles(&solver));
+  assert(grid[0] == 0x01);
+  assert(grid[9] == 0x1FE);
+  assert(grid[72] == 0x1FE);
+}
+
+static void test_unit_without_place_for_value_fails() {
+  struct solver solver = { .trail_size = 0 };
+  uint16_t *grid = solver.grid;
+  default_grid_values(grid);
+
+  for (int i = 0; i < 9; ++i) {
+    grid[i * 9] &= ~0x10;
+  }
+
+  assert(!place_hidden_singles(&solver));
+}
+
+static void test_undo_restores_grid_to_mark() {
+  struct solver solver;
+  uint16_t before[81] = {0};
+  default_grid_values(before);
+  init_solver(&solver, before);
+
+  assert(assign(&solver, 0, 0x01));
+  const int mark = solver.trail_size;
+  copy_grid(solver.grid, before);
+
+  assert(assign(&solver, 40, 0x02));
+  assert(solver.grid[40] == 0x02);
+  assert(solver.trail_size > mark);
+
+  undo(&solver, mark);
+  assert(solver.trail_size == mark);
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    assert(solver.grid[i] == before[i]);
+  }
+}
+
+static void test_peer_boards_match_peers() {
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    bitboard expected = 0;
+
+    for (int j = 0; j < NUMBER_OF_PEERS; ++j) {
+      expected |= SQUARE_BIT(PEERS[i][j]);
+    }
+
+    assert(PEER_BOARDS[i] == expected);
+  }
+}
+
+static void test_bitboard_assign_clears_peers() {
+  struct bitboard_grid grid;
+  default_bitboard_values(&grid);
+
+  bitboard_assign(&grid, 0, 3);
+
+  assert(bitboard_propagate(&grid));
+  assert(grid.values[3] == (ALL_SQUARES & ~PEER_BOARDS[0]));
+
+  for (int i = 0; i < 9; ++i) {
+    assert(((grid.values[i] & SQUARE_BIT(0)) != 0) == (i == 3));
+  }
 }
 
 
@@ -497,119 +5942,1346 @@ static const char *TOP_95_PUZZLES[] =
    "3...8.......7....51..............36...2..4....7...........6.13..452...........8..",
   };
 
-static const int TOP_95_COUNT = sizeof(TOP_95_PUZZLES) / sizeof(TOP_95_PUZZLES[0]);
+static const int TOP_95_COUNT = sizeof(TOP_95_PUZZLES) / sizeof(TOP_95_PUZZLES[0]);
+
+/*
+
+  Integration Tests
+
+*/
+
+static _Bool puzzle_can_be_solved(const struct engine *engine, const char puzzle[82]) {
+  uint16_t grid[81] = {0};
+  default_grid_values(grid);
+
+  return engine->solve(puzzle, grid);
+}
+
+static _Bool solution_is_valid(const char puzzle[82], const uint16_t grid[81]) {
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    if (grid[i] == 0 || (grid[i] & (grid[i] - 1)) != 0) {
+      return false;
+    }
+
+    if (puzzle[i] >= '1' && puzzle[i] <= '9' && grid[i] != 1u << (puzzle[i] - 49)) {
+      return false;
+    }
+
+    for (int j = 0; j < NUMBER_OF_PEERS; ++j) {
+      if (grid[PEERS[i][j]] == grid[i]) {
+	return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static void test_solve_leaves_solution_in_grid(const struct engine *engine) {
+  const char *puzzles[] = { EASY_50_PUZZLES[0], HARDEST_11_PUZZLES[1], TOP_95_PUZZLES[2] };
+
+  for (int i = 0; i < 3; ++i) {
+    uint16_t grid[81] = {0};
+    default_grid_values(grid);
+
+    assert(engine->solve(puzzles[i], grid));
+    assert(solution_is_valid(puzzles[i], grid));
+  }
+}
+
+static void test_parallel_search_solves_samples() {
+  const char *puzzles[] = { EASY_50_PUZZLES[0], HARDEST_11_PUZZLES[5], TOP_95_PUZZLES[24], TOP_95_PUZZLES[67] };
+
+  for (int i = 0; i < 4; ++i) {
+    uint16_t grid[81] = {0};
+    default_grid_values(grid);
+
+    assert(solve_in_parallel(puzzles[i], grid, 4));
+    assert(solution_is_valid(puzzles[i], grid));
+  }
+}
+
+static void assert_search_targets_agree(const uint16_t grid[GRID_SIZE]) {
+  int expected = -1;
+  const _Bool found = scalar_search_target(grid, &expected);
+
+  _Bool (*targets[3])(const uint16_t grid[GRID_SIZE], int *square) = { search_target };
+  int count = 1;
+
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("sse4.1")) {
+    targets[count++] = sse_search_target;
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    targets[count++] = avx2_search_target;
+  }
+#endif
+
+  for (int i = 0; i < count; ++i) {
+    int square = -1;
+
+    assert(targets[i](grid, &square) == found);
+    assert(!found || square == expected);
+  }
+}
+
+static void test_search_targets_agree() {
+  struct solver solver;
+
+  for (int i = 0; i < TOP_95_COUNT; ++i) {
+    uint16_t grid[81] = {0};
+    default_grid_values(grid);
+    init_solver(&solver, grid);
+
+    assert(assign_puzzle(TOP_95_PUZZLES[i], &solver));
+    assert_search_targets_agree(solver.grid);
+  }
+
+  assert(search(&solver, NULL));
+  assert_search_targets_agree(solver.grid);
+
+  // Only the last square is left open.
+  solver.grid[80] = 0x101;
+  assert_search_targets_agree(solver.grid);
+}
+
+static void test_counts_solutions_up_to_limit() {
+  // A solved grid with a swappable rectangle of 8s and 6s left open.
+  const char two_solutions[] = "4.3921.579.7345.21251876493548132976729564138136798245372689514814253769695417382";
+  const char empty[] = ".................................................................................";
+  const char contradiction[] = "11...............................................................................";
+
+  assert(count_solutions(two_solutions, 1) == 1);
+  assert(count_solutions(two_solutions, 2) == 2);
+  assert(count_solutions(two_solutions, 5) == 2);
+  assert(count_solutions(empty, 2) == 2);
+  assert(count_solutions(empty, 100) == 100);
+  assert(count_solutions(contradiction, 2) == 0);
+
+  for (int i = 0; i < EASY_50_COUNT; ++i) {
+    assert(count_solutions(EASY_50_PUZZLES[i], 2) == 1);
+  }
+
+  for (int i = 0; i < TOP_95_COUNT; ++i) {
+    assert(count_solutions(TOP_95_PUZZLES[i], 2) == 1);
+  }
+}
+
+#ifdef SUDOKU_STATS
+static void test_engines_count_the_same_search() {
+  // These engines make the same guesses in the same order.
+  static const char *names[] = { "norvig", "bitboard", "generic" };
+  static const int count = sizeof(names) / sizeof(names[0]);
+
+  for (int i = 0; i < HARDEST_11_COUNT; ++i) {
+    struct solve_stats stats[count];
+
+    for (int j = 0; j < count; ++j) {
+      uint16_t grid[81] = {0};
+      default_grid_values(grid);
+
+      assert(find_engine(names[j])->solve(HARDEST_11_PUZZLES[i], grid));
+      stats[j] = solve_stats;
+    }
+
+    assert(stats[0].nodes > 0);
+
+    for (int j = 1; j < count; ++j) {
+      assert(stats[0].nodes == stats[j].nodes);
+      assert(stats[0].guesses == stats[j].guesses);
+      assert(stats[0].backtracks == stats[j].backtracks);
+      assert(stats[0].max_depth == stats[j].max_depth);
+    }
+  }
+}
+#endif
+
+// Applies a pseudo random symmetry of the sudoku to puzzle, chosen by seed.
+static void shuffle_puzzle(const char puzzle[82], uint64_t seed, char shuffled[82]) {
+  uint8_t rows[9];
+  uint8_t columns[9];
+  char digits[10] = ".123456789";
+
+  const uint8_t *bands = PERMUTATIONS_OF_3[(seed = mix_key(seed)) % 6];
+  const uint8_t *stacks = PERMUTATIONS_OF_3[(seed = mix_key(seed)) % 6];
+
+  for (int line = 0; line < 9; line += 3) {
+    const uint8_t *within_rows = PERMUTATIONS_OF_3[(seed = mix_key(seed)) % 6];
+    const uint8_t *within_columns = PERMUTATIONS_OF_3[(seed = mix_key(seed)) % 6];
+
+    for (int i = 0; i < 3; ++i) {
+      rows[line + i] = (uint8_t)(bands[line / 3] * 3 + within_rows[i]);
+      columns[line + i] = (uint8_t)(stacks[line / 3] * 3 + within_columns[i]);
+    }
+  }
+
+  for (int i = 9; i > 1; --i) {
+    const int j = 1 + (int)((seed = mix_key(seed)) % (uint64_t)i);
+    const char digit = digits[i];
+    digits[i] = digits[j];
+    digits[j] = digit;
+  }
+
+  const _Bool transpose = (seed = mix_key(seed)) & 1;
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    const int square = rows[i / 9] * 9 + columns[i % 9];
+    const char value = puzzle[transpose ? (square % 9) * 9 + square / 9 : square];
+
+    shuffled[i] = value >= '1' && value <= '9' ? digits[value - '0'] : '.';
+  }
+
+  shuffled[NUMBER_OF_SQUARES] = '\0';
+}
+
+static void test_canonical_form_is_shared_by_shuffled_puzzles() {
+  const char **sets[] = { EASY_50_PUZZLES, TOP_95_PUZZLES };
+  const int counts[] = { EASY_50_COUNT, TOP_95_COUNT };
+
+  for (int set = 0; set < 2; ++set) {
+    for (int i = 0; i < counts[set]; ++i) {
+      char canonical[82];
+      struct transform transform;
+
+      assert(canonicalize(sets[set][i], canonical, &transform));
+
+      for (uint64_t seed = 1; seed <= 8; ++seed) {
+	char shuffled[82];
+	char shuffled_canonical[82];
+
+	shuffle_puzzle(sets[set][i], seed * 1000 + (uint64_t)i, shuffled);
+	assert(canonicalize(shuffled, shuffled_canonical, &transform));
+	assert(strcmp(canonical, shuffled_canonical) == 0);
+      }
+    }
+  }
+}
+
+static void test_canonical_solution_maps_back() {
+  for (int i = 0; i < HARDEST_11_COUNT; ++i) {
+    char canonical[82];
+    struct transform transform;
+    uint16_t grid[81] = {0};
+    uint16_t mapped[81] = {0};
+    char solution[81];
+
+    assert(canonicalize(HARDEST_11_PUZZLES[i], canonical, &transform));
+
+    default_grid_values(grid);
+    assert(solve(HARDEST_11_PUZZLES[i], grid));
+    apply_transform(&transform, grid, solution);
+    apply_inverse_transform(&transform, solution, mapped);
+
+    for (int j = 0; j < NUMBER_OF_SQUARES; ++j) {
+      assert(mapped[j] == grid[j]);
+    }
+
+    // The mapped solution solves the canonical puzzle.
+    for (int j = 0; j < NUMBER_OF_SQUARES; ++j) {
+      assert(canonical[j] == '.' || canonical[j] == solution[j]);
+    }
+  }
+}
+
+static void test_nearly_empty_puzzles_are_not_canonicalized() {
+  char canonical[82];
+  struct transform transform;
+
+  assert(!canonicalize(".................................................................................", canonical, &transform));
+  assert(!canonicalize("x................................................................................", canonical, &transform));
+}
+
+static void test_solution_cache_solves_shuffled_puzzles() {
+  struct solution_cache *cache = create_cache(64);
+  assert(cache != NULL);
+
+  for (uint64_t seed = 0; seed < 4; ++seed) {
+    for (int i = 0; i < HARDEST_11_COUNT; ++i) {
+      char shuffled[82];
+      uint16_t grid[81] = {0};
+      default_grid_values(grid);
+
+      shuffle_puzzle(HARDEST_11_PUZZLES[i], seed, shuffled);
+      assert(solve_cached(cache, &ENGINES[0], shuffled, grid));
+      assert(solution_is_valid(shuffled, grid));
+    }
+  }
+
+  assert(atomic_load(&cache->misses) <= (unsigned long)HARDEST_11_COUNT);
+  assert(atomic_load(&cache->hits) >= 3 * (unsigned long)HARDEST_11_COUNT);
+
+  // A cache read back from a file answers without solving again.
+  FILE *file = tmpfile();
+  assert(file != NULL);
+  write_cache(cache, file);
+  destroy_cache(cache);
+
+  cache = create_cache(64);
+  assert(cache != NULL);
+  rewind(file);
+  read_cache(cache, file);
+  fclose(file);
+
+  for (int i = 0; i < HARDEST_11_COUNT; ++i) {
+    uint16_t grid[81] = {0};
+    default_grid_values(grid);
+
+    assert(solve_cached(cache, &ENGINES[0], HARDEST_11_PUZZLES[i], grid));
+    assert(solution_is_valid(HARDEST_11_PUZZLES[i], grid));
+  }
+
+  assert(atomic_load(&cache->misses) == 0);
+
+  destroy_cache(cache);
+}
+
+static void test_corrupt_cache_lines_are_skipped() {
+  const char *puzzle = HARDEST_11_PUZZLES[0];
+  char canonical[82];
+  struct transform transform;
+  uint16_t grid[81] = {0};
+  char solution[82];
+
+  assert(canonicalize(puzzle, canonical, &transform));
+  default_grid_values(grid);
+  assert(solve(canonical, grid));
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    solution[i] = (char)('1' + __builtin_ctz(grid[i]));
+  }
+
+  solution[NUMBER_OF_SQUARES] = '\0';
+
+  const int open_square = (int)(strchr(canonical, '.') - canonical);
+  const int clue_square = open_square == 0 ? 1 : 0;
+
+  for (int corruption = 0; corruption < 6; ++corruption) {
+    char corrupt[82];
+    strcpy(corrupt, solution);
+
+    switch (corruption) {
+    case 0:
+      corrupt[open_square] = '0';
+      break;
+    case 1:
+      corrupt[open_square] = '.';
+      break;
+    case 2:
+      corrupt[open_square] = 'x';
+      break;
+    case 3:
+      // Still a digit, but the same as one of its peers.
+      corrupt[open_square] = corrupt[PEERS[open_square][0]];
+      break;
+    case 4:
+      corrupt[clue_square] = corrupt[clue_square] == '9' ? '1' : (char)(corrupt[clue_square] + 1);
+      break;
+    case 5:
+      corrupt[40] = '\0';
+      break;
+    }
+
+    FILE *file = tmpfile();
+    assert(file != NULL);
+    fprintf(file, "%s %s\n%.81s\n", canonical, corrupt, "x................................................................................");
+    rewind(file);
+
+    struct solution_cache *cache = create_cache(64);
+    assert(cache != NULL);
+    read_cache(cache, file);
+    fclose(file);
+
+    default_grid_values(grid);
+    assert(solve_cached(cache, &ENGINES[0], puzzle, grid));
+    assert(solution_is_valid(puzzle, grid));
+    assert(atomic_load(&cache->misses) == 1);
+
+    destroy_cache(cache);
+  }
+}
+
+static void test_invalid_puzzles_do_not_solve(const struct engine *engine) {
+  static const char *puzzles[] =
+    {
+     "111111111111111111111111111111111111111111111111111111111111111111111111111111111",
+     "11...............................................................................",
+     "11.............................................................................22",
+     "11...................................55555.....................................22",
+     "11..................44444444444444...55555.33333333..9999999999999999999999999.22",
+    };
+
+  static int count = sizeof(puzzles) / sizeof(puzzles[0]);
+
+  for (int i = 0; i < count; ++i) {
+    assert(puzzle_can_be_solved(engine, puzzles[i]) == false);
+  }
+}
+
+static void test_solves_easy_50_samples(const struct engine *engine) {
+  assert(puzzle_can_be_solved(engine, EASY_50_PUZZLES[0]));
+  assert(puzzle_can_be_solved(engine, EASY_50_PUZZLES[16]));
+  assert(puzzle_can_be_solved(engine, EASY_50_PUZZLES[22]));
+  assert(puzzle_can_be_solved(engine, EASY_50_PUZZLES[37]));
+  assert(puzzle_can_be_solved(engine, EASY_50_PUZZLES[45]));
+}
+
+static void test_solves_hardest_11_samples(const struct engine *engine) {
+  assert(puzzle_can_be_solved(engine, HARDEST_11_PUZZLES[1]));
+  assert(puzzle_can_be_solved(engine, HARDEST_11_PUZZLES[2]));
+  assert(puzzle_can_be_solved(engine, HARDEST_11_PUZZLES[5]));
+  assert(puzzle_can_be_solved(engine, HARDEST_11_PUZZLES[9]));
+  assert(puzzle_can_be_solved(engine, HARDEST_11_PUZZLES[10]));
+}
+
+static void test_solves_top_95_samples(const struct engine *engine) {
+  assert(puzzle_can_be_solved(engine, TOP_95_PUZZLES[2]));
+  assert(puzzle_can_be_solved(engine, TOP_95_PUZZLES[24]));
+  assert(puzzle_can_be_solved(engine, TOP_95_PUZZLES[67]));
+  assert(puzzle_can_be_solved(engine, TOP_95_PUZZLES[73]));
+  assert(puzzle_can_be_solved(engine, TOP_95_PUZZLES[81]));
+}
+
+static _Bool sized_solution_is_valid(const char *puzzle, const char *solution, int box) {
+  const int size = box * box;
+
+  for (int i = 0; i < size * size; ++i) {
+    if (puzzle[i] != '.' && puzzle[i] != solution[i]) {
+      return false;
+    }
+  }
+
+  for (int unit = 0; unit < size; ++unit) {
+    uint32_t row = 0;
+    uint32_t column = 0;
+    uint32_t box_values = 0;
+
+    for (int i = 0; i < size; ++i) {
+      const int box_square = (unit / box * box + i / box) * size + unit % box * box + i % box;
+
+      row |= 1u << symbol_value(solution[unit * size + i]);
+      column |= 1u << symbol_value(solution[i * size + unit]);
+      box_values |= 1u << symbol_value(solution[box_square]);
+    }
+
+    const uint32_t all = (1u << size) - 1;
+
+    if (row != all || column != all || box_values != all) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void test_solves_other_sizes() {
+  static const char *puzzles[] =
+    {
+     "13.4...33...4.32",
+     "A2......6.C..4.."
+     ".6.3.A2.F.....8."
+     "B8G...F.2EA.3..5"
+     "4.D......7B..A.."
+     "..B...D..6.AF35."
+     "..A..7G2..3....."
+     "35C....6D.1427G."
+     "1..8C.5F....6.9A"
+     "D.F46.EC1BG...72"
+     ".18B.D.4.A92C..."
+     "9.2A...........F"
+     "..6.....3..F...."
+     "2B.91....56E.F.."
+     ".4.G3....9.75..E"
+     "...5....C..3G..."
+     "FC...6.5.G81.2..",
+     "F...69..12.KA.4....M.I..."
+     ".DNBI.JM..9.P...8F6..G..C"
+     "4KACG..O.FL......5.....19"
+     "...L..GAK4B...591...O...E"
+     "2...3.I..5E.O6F....A..H.."
+     "E...F.2139M..4.N.L..D5..."
+     "L..N.M4..CP.D.B.3921..E.."
+     "B.D.5..7..O312....F..4CGM"
+     "931.2..DI..68F.M.C4K.HL.."
+     ".GKM4..8..NJ7.LP..5.1293O"
+     "....91B.5PK..E.7.MC...N.D"
+     "P.I1B.L.H.8....KFAE..C.4."
+     ".HJDL....M...B....9..EAF."
+     "...7.K.6..D...N15.BI39..8"
+     "..6.E8.32.74GC.DH....B..."
+     "6O..821.P.4..KGHM...LDI.5"
+     "..B.15D....O98..A....7.MH"
+     "G.E....9O6H.C7J5N..LB1.P."
+     ".M.H.4K.AG5NLDI2.31B986.F"
+     "...5DH.CM.2P.1.....9....4"
+     "1B.3..N.L...2.8GEKA.4M..J"
+     ".926..P...G.F...C..4H.D.I"
+     "D.HINJM.C7..5P.6.8..F.KE."
+     "KE.G..O.9.JC4M..L..H5..B3"
+     "7..J..AF..ILHN.3...5...96",
+    };
+
+  static const int boxes[] = { 2, 4, 5 };
+
+  for (int i = 0; i < 3; ++i) {
+    const size_t length = strlen(puzzles[i]);
+    const struct puzzle_size *size = find_puzzle_size(length);
+    char solution[MAX_SQUARES];
+
+    assert(size != NULL && (size_t)size->squares == length);
+    assert(size->solve_line(puzzles[i], solution));
+    assert(sized_solution_is_valid(puzzles[i], solution, boxes[i]));
+  }
+
+  assert(find_puzzle_size(NUMBER_OF_SQUARES) == NULL);
+  assert(find_puzzle_size(100) == NULL);
+}
+
+static void test_counts_solutions_of_other_sizes() {
+  char solution[16];
+
+  // All 4×4 grids.
+  assert(box2_count_solutions("................", 1000) == 288);
+  assert(box2_count_solutions("13.4...33...4.32", 2) == 1);
+  assert(box2_count_solutions("11..............", 2) == 0);
+  assert(!box2_solve_line("11..............", solution));
+}
+
+// Norvig's hard1, which has many solutions but takes the norvig search
+// hundreds of thousands of nodes to find one.
+static void test_auto_engine_hands_long_searches_to_dlx() {
+  const char hard1[] = ".....6....59.....82....8....45........3........6..3.54...325..6..................";
+
+  for (int i = 0; i < 2; ++i) {
+    uint16_t grid[81] = {0};
+    default_grid_values(grid);
+
+    assert(find_engine(i == 0 ? "auto" : "dlx")->solve(hard1, grid));
+    assert(solution_is_valid(hard1, grid));
+  }
+}
+
+static void test_budgets_stop_long_searches() {
+  const char hard1[] = ".....6....59.....82....8....45........3........6..3.54...325..6..................";
+
+  // The grid propagation leaves before the first guess.
+  uint16_t root[81] = {0};
+  default_grid_values(root);
+
+  struct solver solver;
+  init_solver(&solver, root);
+  assert(assign_puzzle(hard1, &solver));
+  copy_grid(solver.grid, root);
+
+  const char *engines[] = { "norvig", "auto", "dlx" };
+
+  for (int i = 0; i < 3; ++i) {
+    for (int deadline = 0; deadline < 2; ++deadline) {
+      // Dancing links needs fewer guesses than a deadline check takes.
+      if (deadline && i == 2) {
+	continue;
+      }
+
+      uint16_t grid[81] = {0};
+      default_grid_values(grid);
+      start_budget(deadline ? 0 : 1, deadline ? 1e-9 : 0);
+
+      assert(!find_engine(engines[i])->solve(hard1, grid));
+      assert(solve_budget.exhausted);
+
+      for (int j = 0; j < NUMBER_OF_SQUARES; ++j) {
+	assert(i == 2 ? hard1[j] == '.' || grid[j] == 1 << (hard1[j] - '1') : grid[j] == root[j]);
+      }
+    }
+  }
+
+  start_budget(0, 0);
+
+  char partial[81];
+  char solution[81];
+  char retried[81];
+
+  assert(sudoku_solve_limited(hard1, partial, 1, 0) == SUDOKU_TIMED_OUT);
+  assert(memchr(partial, '.', sizeof(partial)) != NULL);
+  assert(sudoku_solve(hard1, solution) == SUDOKU_SOLVED);
+  assert(sudoku_solve(partial, retried) == SUDOKU_SOLVED);
+  assert(memcmp(solution, retried, sizeof(solution)) == 0);
+  assert(strcmp(sudoku_status_name(SUDOKU_TIMED_OUT), "timed out") == 0);
+}
+
+static void test_generic_engine_matches_norvig() {
+  const char two_solutions[] = "4.3921.579.7345.21251876493548132976729564138136798245372689514814253769695417382";
+
+  assert(box3_count_solutions(two_solutions, 5) == count_solutions(two_solutions, 5));
+  assert(box3_count_solutions(TOP_95_PUZZLES[7], 2) == 1);
+
+  for (int i = 0; i < HARDEST_11_COUNT; ++i) {
+    uint16_t grid[81] = {0};
+    char solution[81];
+
+    default_grid_values(grid);
+    assert(solve(HARDEST_11_PUZZLES[i], grid));
+    assert(box3_solve_line(HARDEST_11_PUZZLES[i], solution));
+
+    for (int j = 0; j < NUMBER_OF_SQUARES; ++j) {
+      assert(solution[j] == '1' + __builtin_ctz(grid[j]));
+    }
+  }
+}
 
 /*
 
-  Integration Tests
+  Test Runner
 
 */
 
-static _Bool puzzle_can_be_solved(const char puzzle[82]) {
-  uint_fast16_t grid[81] = {0};
-  default_grid_values(grid);
+static void test_generated_puzzles_are_unique() {
+  for (uint64_t i = 0; i < 20; ++i) {
+    char puzzle[82];
+    char again[82];
+    const int clues = generate_puzzle(1, i, 30, puzzle);
+
+    assert(clues <= 30);
+    assert(count_solutions(puzzle, 2) == 1);
+
+    int given = 0;
+
+    for (int square = 0; square < NUMBER_OF_SQUARES; ++square) {
+      given += puzzle[square] != '.';
+    }
+
+    assert(given == clues);
 
-  return solve(puzzle, grid);
+    (void)generate_puzzle(1, i, 30, again);
+    assert(strcmp(puzzle, again) == 0);
+  }
 }
 
-static void test_invalid_puzzles_do_not_solve() {
-  static const char *puzzles[] =
-    {
-     "111111111111111111111111111111111111111111111111111111111111111111111111111111111",
-     "11...............................................................................",
-     "11.............................................................................22",
-     "11...................................55555.....................................22",
-     "11..................44444444444444...55555.33333333..9999999999999999999999999.22",
-    };
+static void test_library_reports_statuses() {
+  const char *invalid = "x................................................................................";
+  char puzzles[3 * 81];
+  char solutions[3 * 81];
+  enum sudoku_status statuses[3];
 
-  static int count = sizeof(puzzles) / sizeof(puzzles[0]);
+  memcpy(puzzles, EASY_50_PUZZLES[0], 81);
+  memcpy(puzzles + 81, "11...............................................................................", 81);
+  memcpy(puzzles + 162, invalid, 81);
 
-  for (int i = 0; i < count; ++i) {
-    assert(puzzle_can_be_solved(puzzles[i]) == false);
+  assert(sudoku_solve_batch(puzzles, 3, solutions, statuses) == 1);
+  assert(statuses[0] == SUDOKU_SOLVED);
+  assert(statuses[1] == SUDOKU_NO_SOLUTION);
+  assert(statuses[2] == SUDOKU_INVALID_INPUT);
+  assert(solutions[81] == '.' && solutions[161] == '.');
+
+  uint16_t grid[81];
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    grid[i] = (uint16_t)(1 << (solutions[i] - '1'));
+  }
+
+  assert(solution_is_valid(EASY_50_PUZZLES[0], grid));
+
+  assert(sudoku_solve(invalid, solutions) == SUDOKU_INVALID_INPUT);
+  assert(sudoku_count_solutions(invalid, 2) == -1);
+  assert(sudoku_count_solutions(TOP_95_PUZZLES[0], 2) == 1);
+  assert(strcmp(sudoku_status_name(SUDOKU_NO_SOLUTION), "no solution") == 0);
+}
+
+static void test_coordinator_matches_one_process() {
+  const struct solve_options options = { .engine = find_engine("auto") };
+  char input[] = "/tmp/sudoku-input-XXXXXX";
+  char output[] = "/tmp/sudoku-output-XXXXXX";
+  char flag[] = "/tmp/sudoku-flag-XXXXXX";
+  const int input_fd = mkstemp(input);
+  const int output_fd = mkstemp(output);
+  const int flag_fd = mkstemp(flag);
+  char expected[(HARDEST_11_COUNT + 2) * (NUMBER_OF_SQUARES + 1)];
+  char *end = expected;
+
+  assert(input_fd >= 0 && output_fd >= 0 && flag_fd >= 0);
+  close(flag_fd);
+  unlink(flag);
+
+  for (int i = 0; i < HARDEST_11_COUNT; ++i) {
+    assert(write_all(input_fd, HARDEST_11_PUZZLES[i], NUMBER_OF_SQUARES) && write_all(input_fd, "\n", 1));
+    end = format_solution(&options, HARDEST_11_PUZZLES[i], NUMBER_OF_SQUARES, end);
+  }
+
+  assert(write_all(input_fd, "\nnot a puzzle", 14));
+  end = format_solution(&options, "", 0, end);
+  end = format_solution(&options, "not a puzzle", 12, end);
+  close(input_fd);
+
+  // In the second run, the worker that gets to create flag first exits
+  // without reading its shard.
+  char self[256] = {0};
+  char command[768];
+
+  assert(readlink("/proc/self/exe", self, sizeof(self) - 1) > 0);
+  snprintf(command, sizeof(command), "mkdir %s 2>/dev/null && exit 1; exec %s", flag, self);
+
+  for (int run = 0; run < 2; ++run) {
+    struct coordinator_stats stats;
+    char solutions[sizeof(expected) + 1];
+
+    assert(ftruncate(output_fd, 0) == 0 && lseek(output_fd, 0, SEEK_SET) == 0);
+
+    // The retry is counted in stats, so its report on stderr, which the
+    // workers share, is dropped.
+    fflush(stderr);
+    const int saved_stderr = dup(STDERR_FILENO);
+    const int null_fd = open("/dev/null", O_WRONLY);
+    assert(saved_stderr >= 0 && null_fd >= 0 && dup2(null_fd, STDERR_FILENO) >= 0);
+    close(null_fd);
+
+    const _Bool coordinated = coordinate(input, output_fd, 3, run == 0 ? NULL : command, &options, &stats);
+
+    fflush(stderr);
+    assert(dup2(saved_stderr, STDERR_FILENO) >= 0);
+    close(saved_stderr);
+
+    assert(coordinated);
+    assert(pread(output_fd, solutions, sizeof(solutions), 0) == end - expected);
+    assert(memcmp(solutions, expected, (size_t)(end - expected)) == 0);
+    assert(stats.lines == HARDEST_11_COUNT + 2 && stats.empty == 2 && stats.retries == run);
   }
+
+  close(output_fd);
+  unlink(input);
+  unlink(output);
+  rmdir(flag);
 }
 
-static void test_solves_easy_50_samples() {
-  assert(puzzle_can_be_solved(EASY_50_PUZZLES[0]));
-  assert(puzzle_can_be_solved(EASY_50_PUZZLES[16]));
-  assert(puzzle_can_be_solved(EASY_50_PUZZLES[22]));
-  assert(puzzle_can_be_solved(EASY_50_PUZZLES[37]));
-  assert(puzzle_can_be_solved(EASY_50_PUZZLES[45]));
+static void test_packed_records_round_trip() {
+  char record[PACKED_RECORD_SIZE];
+  char puzzle[82];
+
+  for (int i = 0; i < TOP_95_COUNT; ++i) {
+    pack_puzzle(TOP_95_PUZZLES[i], NUMBER_OF_SQUARES, record);
+    assert(unpack_puzzle(record, puzzle));
+    assert(strcmp(puzzle, TOP_95_PUZZLES[i]) == 0);
+  }
+
+  // Lines that are not puzzles come back as empty lines.
+  pack_puzzle("12", 2, record);
+  assert(!unpack_puzzle(record, puzzle));
+  pack_puzzle(EASY_50_PUZZLES[0], NUMBER_OF_SQUARES - 1, record);
+  assert(!unpack_puzzle(record, puzzle));
+
+  uint64_t count = 0;
+  char header[PACKED_HEADER_SIZE];
+
+  pack_header(1234567890123, header);
+  assert(unpack_header(header, sizeof(header), &count) && count == 1234567890123);
+  assert(!unpack_header(EASY_50_PUZZLES[0], NUMBER_OF_SQUARES, &count));
 }
 
-static void test_solves_hardest_11_samples() {
-  assert(puzzle_can_be_solved(HARDEST_11_PUZZLES[1]));
-  assert(puzzle_can_be_solved(HARDEST_11_PUZZLES[2]));
-  assert(puzzle_can_be_solved(HARDEST_11_PUZZLES[5]));
-  assert(puzzle_can_be_solved(HARDEST_11_PUZZLES[9]));
-  assert(puzzle_can_be_solved(HARDEST_11_PUZZLES[10]));
+static void test_packed_solutions_match_text() {
+  const struct solve_options text = { .engine = &ENGINES[0], .search_threads = 1 };
+  const struct solve_options packed = { .engine = &ENGINES[0], .search_threads = 1,
+					.packed_input = true, .packed_output = true };
+
+  for (int i = 0; i < HARDEST_11_COUNT; ++i) {
+    char record[PACKED_RECORD_SIZE];
+    char packed_solution[PACKED_RECORD_SIZE];
+    char solution[NUMBER_OF_SQUARES + 1];
+    char unpacked[82];
+
+    pack_puzzle(HARDEST_11_PUZZLES[i], NUMBER_OF_SQUARES, record);
+    assert(format_record(&packed, record, sizeof(record), packed_solution) == packed_solution + PACKED_RECORD_SIZE);
+    assert(format_record(&text, HARDEST_11_PUZZLES[i], NUMBER_OF_SQUARES, solution) == solution + sizeof(solution));
+    assert(unpack_puzzle(packed_solution, unpacked));
+    assert(memcmp(unpacked, solution, NUMBER_OF_SQUARES) == 0);
+  }
 }
 
-static void test_solves_top_95_samples() {
-  assert(puzzle_can_be_solved(TOP_95_PUZZLES[2]));
-  assert(puzzle_can_be_solved(TOP_95_PUZZLES[24]));
-  assert(puzzle_can_be_solved(TOP_95_PUZZLES[67]));
-  assert(puzzle_can_be_solved(TOP_95_PUZZLES[73]));
-  assert(puzzle_can_be_solved(TOP_95_PUZZLES[81]));
+static void test_convert_empties_overlong_lines() {
+  const struct solve_options convert = { .engine = &ENGINES[0], .search_threads = 1, .convert = true };
+  const size_t long_length = 2 * OUTPUT_BUFFER_SIZE;
+  char *input = malloc(2 * long_length + NUMBER_OF_SQUARES + 3);
+  struct output_buffer *out = malloc(sizeof(*out));
+  char path[] = "/tmp/sudoku-convert-XXXXXX";
+
+  assert(input != NULL && out != NULL);
+
+  // An overlong line, a puzzle, and an overlong last line without a newline.
+  char *end = input;
+  memset(end, '1', long_length);
+  end += long_length;
+  *end++ = '\n';
+  memcpy(end, HARDEST_11_PUZZLES[0], NUMBER_OF_SQUARES);
+  end += NUMBER_OF_SQUARES;
+  *end++ = '\n';
+  memset(end, '2', long_length);
+  end += long_length;
+
+  out->fd = mkstemp(path);
+  out->options = &convert;
+  out->used = 0;
+  assert(out->fd >= 0);
+
+  const char *rest = solve_lines(input, end, out);
+  assert(rest == end - long_length);
+  assert(write_solution(out, rest, long_length) && flush_output(out));
+
+  char output[NUMBER_OF_SQUARES + 4];
+  assert(pread(out->fd, output, sizeof(output), 0) == NUMBER_OF_SQUARES + 3);
+  assert(output[0] == '\n' && output[NUMBER_OF_SQUARES + 1] == '\n' && output[NUMBER_OF_SQUARES + 2] == '\n');
+  assert(memcmp(output + 1, HARDEST_11_PUZZLES[0], NUMBER_OF_SQUARES) == 0);
+
+  close(out->fd);
+  unlink(path);
+  free(out);
+  free(input);
 }
 
-/*
+static void test_lockstep_solves_what_propagation_solves() {
+  if (lockstep_solve == NULL) {
+    return;
+  }
 
-  Test Runner
+  const char *puzzles[LOCKSTEP_LANES];
+  uint16_t grids[LOCKSTEP_LANES][81];
+  int solved_count = 0;
 
-*/
+  for (int first = 0; first < EASY_50_COUNT; first += LOCKSTEP_LANES) {
+    const int count = EASY_50_COUNT - first < LOCKSTEP_LANES ? EASY_50_COUNT - first : LOCKSTEP_LANES;
+
+    for (int lane = 0; lane < count; ++lane) {
+      puzzles[lane] = EASY_50_PUZZLES[first + lane];
+    }
+
+    const unsigned solved = lockstep_solve(puzzles, count, grids);
+
+    for (int lane = 0; lane < count; ++lane) {
+      uint16_t grid[81] = {0};
+      default_grid_values(grid);
+
+      struct solver solver;
+      init_solver(&solver, grid);
+
+      const _Bool propagated = assign_puzzle(puzzles[lane], &solver);
+      const _Bool open = search_target(solver.grid, &(int){ 0 });
+
+      assert(((solved >> lane & 1) != 0) == (propagated && !open));
+
+      if (solved >> lane & 1) {
+	assert(memcmp(grids[lane], solver.grid, sizeof(grids[lane])) == 0);
+	++solved_count;
+      }
+    }
+  }
+
+  assert(solved_count > EASY_50_COUNT / 2);
+
+  // Contradictions and bad symbols are left to the scalar engines.
+  puzzles[0] = "11...............................................................................";
+  puzzles[1] = "x................................................................................";
+  assert(lockstep_solve(puzzles, 2, grids) == 0);
+}
+
+static void test_propagation_levels_find_the_same_solutions() {
+  for (int level = 1; level < PROPAGATION_COUNT; ++level) {
+    for (int i = 0; i < TOP_95_COUNT; ++i) {
+      uint16_t expected[81] = {0};
+      uint16_t grid[81] = {0};
+
+      default_grid_values(expected);
+      default_grid_values(grid);
+
+      propagation = PROPAGATE_SINGLES;
+      assert(solve(TOP_95_PUZZLES[i], expected));
+      propagation = (enum propagation)level;
+      assert(solve(TOP_95_PUZZLES[i], grid));
+      assert(memcmp(grid, expected, sizeof(grid)) == 0);
+      assert(count_solutions(TOP_95_PUZZLES[i], 2) == 1);
+    }
+
+    // Two solutions, which no deduction may rule out.
+    assert(count_solutions("4.3921.579.7345.21251876493548132976729564138136798245372689514814253769695417382", 3) == 2);
+  }
+
+  propagation = PROPAGATE_SINGLES;
+}
+
+static void test_branching_and_value_orders_find_the_same_solutions() {
+  for (int choice = 0; choice < BRANCHING_COUNT; ++choice) {
+    for (int order = 0; order < VALUE_ORDER_COUNT; ++order) {
+      branching = (enum branching)choice;
+      value_order = (enum value_order)order;
+
+      for (int i = 0; i < TOP_95_COUNT; ++i) {
+	uint16_t grid[81] = {0};
+	default_grid_values(grid);
+
+	assert(solve(TOP_95_PUZZLES[i], grid));
+	assert(solution_is_valid(TOP_95_PUZZLES[i], grid));
+      }
+
+      assert(count_solutions("4.3921.579.7345.21251876493548132976729564138136798245372689514814253769695417382", 3) == 2);
+    }
+  }
+
+  branching = BRANCH_BUCKETS;
+  value_order = ORDER_ASCENDING;
+
+  // Buckets follow every write and undo.
+  uint16_t grid[81] = {0};
+  default_grid_values(grid);
+
+  struct solver solver;
+  init_solver(&solver, grid);
+  assert(assign_puzzle(HARDEST_11_PUZZLES[0], &solver));
+
+  const int mark = solver.trail_size;
+  int bucket_square = -1;
+  int scan_square = -1;
+
+  assert(bucket_target(&solver, &bucket_square) && search_target(solver.grid, &scan_square));
+  assert(bucket_square == scan_square);
+  (void)assign(&solver, bucket_square, solver.grid[bucket_square] & -solver.grid[bucket_square]);
+  undo(&solver, mark);
+  assert(bucket_target(&solver, &bucket_square) && bucket_square == scan_square);
+
+  for (int i = 0; i < NUMBER_OF_SQUARES; ++i) {
+    assert((solver.buckets[VALUE_COUNTS[solver.grid[i]]][i >> 6] >> (i & 63) & 1) == 1);
+  }
+
+  branching = BRANCH_SCAN;
+}
 
 static void run_tests() {
   test_can_eliminate_value_from_peers();
   test_eliminate_only_modifies_peers_with_values_to_remove();
+  test_eliminate_cascades_through_new_singles();
+  test_eliminate_fails_when_a_square_runs_out_of_values();
+  test_places_hidden_single();
+  test_unit_without_place_for_value_fails();
+  test_undo_restores_grid_to_mark();
   
-  test_invalid_puzzles_do_not_solve();
-  test_solves_easy_50_samples();
-  test_solves_hardest_11_samples();
-  test_solves_top_95_samples();
+  test_peer_boards_match_peers();
+  test_bitboard_assign_clears_peers();
+
+  for (int i = 0; i < ENGINE_COUNT; ++i) {
+    test_invalid_puzzles_do_not_solve(&ENGINES[i]);
+    test_solves_easy_50_samples(&ENGINES[i]);
+    test_solves_hardest_11_samples(&ENGINES[i]);
+    test_solves_top_95_samples(&ENGINES[i]);
+    test_solve_leaves_solution_in_grid(&ENGINES[i]);
+  }
+
+  test_parallel_search_solves_samples();
+  test_search_targets_agree();
+  test_counts_solutions_up_to_limit();
+  test_canonical_form_is_shared_by_shuffled_puzzles();
+  test_canonical_solution_maps_back();
+  test_nearly_empty_puzzles_are_not_canonicalized();
+  test_solution_cache_solves_shuffled_puzzles();
+  test_corrupt_cache_lines_are_skipped();
+  test_generated_puzzles_are_unique();
+  test_solves_other_sizes();
+  test_counts_solutions_of_other_sizes();
+  test_generic_engine_matches_norvig();
+  test_auto_engine_hands_long_searches_to_dlx();
+  test_budgets_stop_long_searches();
+  test_library_reports_statuses();
+  test_coordinator_matches_one_process();
+  test_packed_records_round_trip();
+  test_packed_solutions_match_text();
+  test_convert_empties_overlong_lines();
+  test_lockstep_solves_what_propagation_solves();
+  test_propagation_levels_find_the_same_solutions();
+  test_branching_and_value_orders_find_the_same_solutions();
+#ifdef SUDOKU_STATS
+  test_engines_count_the_same_search();
+#endif
   
   printf("All tests passed.\n");
 }
 
 /*
 
-  Profile
+  Benchmark
+
+  Each corpus is solved warmup times untimed, then repetitions times with
+  every puzzle timed on its own. Percentiles are over all timed solves,
+  and the pass time is their sum divided by the repetitions.
 
  */
 
-static _Bool profile_puzzles(const char* puzzles[], int count) {
-  for (int i = 0; i < count; ++i) {
-    uint_fast16_t grid[81] = {0};
-    default_grid_values(grid);
-    
-    if (!solve(puzzles[i], grid)) {
-      return false;
+struct benchmark_result {
+  const char *name;
+  int count;
+  int solved;
+  double seconds;
+  double p50;
+  double p90;
+  double p99;
+  double max;
+#ifdef SUDOKU_STATS
+  // Summed over the puzzles of one pass.
+  struct solve_stats stats;
+#endif
+};
+
+static int compare_seconds(const void *a, const void *b) {
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of count sorted samples.
+static double percentile(const double *sorted, size_t count, int percent) {
+  const size_t rank = (count * (size_t)percent + 99) / 100;
+
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static _Bool benchmark_puzzles(const char *const puzzles[], int count, const struct benchmark_options *options,
+			       struct benchmark_result *result) {
+  const size_t samples = (size_t)count * (size_t)options->repetitions;
+  double *seconds = malloc(sizeof(*seconds) * (samples > 0 ? samples : 1));
+
+  if (seconds == NULL) {
+    return false;
+  }
+
+  result->count = count;
+  result->solved = 0;
+  result->seconds = 0;
+#ifdef SUDOKU_STATS
+  result->stats = (struct solve_stats){ 0 };
+#endif
+
+  // Negative repetitions are the warmup.
+  for (int repetition = -options->warmup; repetition < options->repetitions; ++repetition) {
+    for (int i = 0; i < count; ++i) {
+      uint16_t grid[81] = {0};
+      default_grid_values(grid);
+
+      char canonical[NUMBER_OF_SQUARES + 1];
+      struct transform transform;
+
+      const double start = monotonic_seconds();
+      const _Bool solved =
+	options->canonicalize ? canonicalize(puzzles[i], canonical, &transform) :
+	options->cache != NULL ? solve_cached(options->cache, options->engine, puzzles[i], grid) :
+	options->engine->solve(puzzles[i], grid);
+      const double elapsed = monotonic_seconds() - start;
+
+      if (repetition >= 0) {
+	seconds[(size_t)repetition * (size_t)count + (size_t)i] = elapsed;
+	result->seconds += elapsed;
+      }
+
+      if (repetition == options->repetitions - 1) {
+	result->solved += solved;
+#ifdef SUDOKU_STATS
+	add_stats(&result->stats, &solve_stats);
+#endif
+      }
     }
   }
 
+  result->p50 = result->p90 = result->p99 = result->max = 0;
+
+  if (samples > 0) {
+    qsort(seconds, samples, sizeof(*seconds), compare_seconds);
+
+    result->p50 = percentile(seconds, samples, 50);
+    result->p90 = percentile(seconds, samples, 90);
+    result->p99 = percentile(seconds, samples, 99);
+    result->max = seconds[samples - 1];
+  }
+
+  free(seconds);
+
   return true;
 }
 
-static void profile_easy_50_puzzles() {
-  if (profile_puzzles(EASY_50_PUZZLES, EASY_50_COUNT)) {
-    printf("Solved 50 of 50 easy puzzles\n");
+// Prints name as a CSV field or a JSON string.
+static void print_benchmark_name(const char *name, enum benchmark_format format) {
+  putchar('"');
+
+  for (const char *c = name; *c != '\0'; ++c) {
+    if (*c == '"') {
+      fputs(format == BENCHMARK_CSV ? "\"\"" : "\\\"", stdout);
+    }
+    else if (*c == '\\' && format == BENCHMARK_JSON) {
+      fputs("\\\\", stdout);
+    }
+    else {
+      putchar(*c);
+    }
+  }
+
+  putchar('"');
+}
+
+static void print_benchmark_result(const struct benchmark_result *result, const struct benchmark_options *options,
+				   _Bool first) {
+  const double runs = (double)result->count * options->repetitions;
+  const double pass_ms = result->seconds / options->repetitions * 1e3;
+  const double mean_us = runs > 0 ? result->seconds / runs * 1e6 : 0;
+  const double per_second = result->seconds > 0 ? runs / result->seconds : 0;
+  char method[96];
+
+  if (options->canonicalize) {
+    snprintf(method, sizeof(method), "canonical");
+  }
+  else {
+    // Settings away from their defaults follow the engine's name.
+    int length = snprintf(method, sizeof(method), "%s%s", options->engine->name, options->cache != NULL ? "+cache" : "");
+
+    if (propagation != PROPAGATE_SINGLES) {
+      length += snprintf(method + length, sizeof(method) - (size_t)length, "/%s", PROPAGATION_NAMES[propagation]);
+    }
+
+    if (value_order != ORDER_ASCENDING) {
+      length += snprintf(method + length, sizeof(method) - (size_t)length, "/%s", VALUE_ORDER_NAMES[value_order]);
+    }
+
+    if (branching != BRANCH_SCAN) {
+      snprintf(method + length, sizeof(method) - (size_t)length, "/%s", BRANCHING_NAMES[branching]);
+    }
+  }
+
+  switch (options->format) {
+  case BENCHMARK_TEXT:
+    printf("%s %d of %d %s puzzles with %s (%.3f ms per pass, mean %.1f us, "
+	   "p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us, %.0f puzzles/s)\n",
+	   options->canonicalize ? "Canonicalized" : "Solved",
+	   result->solved, result->count, result->name, method, pass_ms, mean_us,
+	   result->p50 * 1e6, result->p90 * 1e6, result->p99 * 1e6, result->max * 1e6, per_second);
+#ifdef SUDOKU_STATS
+    printf("  ");
+    print_stats(stdout, &result->stats);
+
+    if (result->stats.nodes > 0) {
+      printf(" ns_per_node %.0f", pass_ms * 1e6 / (double)result->stats.nodes);
+    }
+
+    putchar('\n');
+#endif
+    break;
+
+  case BENCHMARK_CSV:
+    if (first) {
+      printf("corpus,engine,puzzles,solved,repetitions,pass_ms,mean_us,p50_us,p90_us,p99_us,max_us,puzzles_per_second");
+#ifdef SUDOKU_STATS
+#define CSV_HEADER(name) printf("," #name);
+      SOLVE_STATS(CSV_HEADER, CSV_HEADER)
+#undef CSV_HEADER
+#endif
+      putchar('\n');
+    }
+
+    print_benchmark_name(result->name, BENCHMARK_CSV);
+    printf(",%s,%d,%d,%d,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f",
+	   method, result->count, result->solved, options->repetitions, pass_ms, mean_us,
+	   result->p50 * 1e6, result->p90 * 1e6, result->p99 * 1e6, result->max * 1e6, per_second);
+#ifdef SUDOKU_STATS
+#define CSV_FIELD(name) printf(",%llu", (unsigned long long)result->stats.name);
+    SOLVE_STATS(CSV_FIELD, CSV_FIELD)
+#undef CSV_FIELD
+#endif
+    putchar('\n');
+    break;
+
+  case BENCHMARK_JSON:
+    printf("%s\n  {\"corpus\": ", first ? "[" : ",");
+    print_benchmark_name(result->name, BENCHMARK_JSON);
+    printf(", \"engine\": \"%s\", \"puzzles\": %d, \"solved\": %d, \"repetitions\": %d, "
+	   "\"pass_ms\": %.6f, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+	   "\"max_us\": %.3f, \"puzzles_per_second\": %.1f",
+	   method, result->count, result->solved, options->repetitions, pass_ms, mean_us,
+	   result->p50 * 1e6, result->p90 * 1e6, result->p99 * 1e6, result->max * 1e6, per_second);
+#ifdef SUDOKU_STATS
+#define JSON_FIELD(name) printf(", \"" #name "\": %llu", (unsigned long long)result->stats.name);
+    SOLVE_STATS(JSON_FIELD, JSON_FIELD)
+#undef JSON_FIELD
+#endif
+    putchar('}');
+    break;
   }
 }
 
-static void profile_hardest_11_puzzles() {
-  if (profile_puzzles(HARDEST_11_PUZZLES, HARDEST_11_COUNT)) {
-    printf("Solved 50 of 50 easy puzzles\n");
+// Reads every 81 character line of path into one allocation, which is
+// returned with *puzzles pointing into it. Other lines are skipped.
+static char *read_puzzles(const char *path, const char ***puzzles, int *count) {
+  FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  char *data = NULL;
+  size_t capacity = 0;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  ssize_t length;
+
+  *count = 0;
+
+  while ((length = getline(&line, &line_capacity, file)) >= 0) {
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+      --length;
+    }
+
+    if (length != NUMBER_OF_SQUARES) {
+      continue;
+    }
+
+    if ((size_t)(*count + 1) * (NUMBER_OF_SQUARES + 1) > capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 1024 * (NUMBER_OF_SQUARES + 1);
+
+      char *grown = realloc(data, capacity);
+
+      if (grown == NULL) {
+	free(data);
+	data = NULL;
+	break;
+      }
+
+      data = grown;
+    }
+
+    memcpy(data + (size_t)*count * (NUMBER_OF_SQUARES + 1), line, NUMBER_OF_SQUARES);
+    data[(size_t)*count * (NUMBER_OF_SQUARES + 1) + NUMBER_OF_SQUARES] = '\0';
+    ++*count;
+  }
+
+  free(line);
+
+  if (file != stdin) {
+    fclose(file);
+  }
+
+  *puzzles = data != NULL ? malloc(sizeof(**puzzles) * (size_t)(*count > 0 ? *count : 1)) : NULL;
+
+  if (*puzzles == NULL) {
+    free(data);
+    return NULL;
   }
+
+  for (int i = 0; i < *count; ++i) {
+    (*puzzles)[i] = data + (size_t)i * (NUMBER_OF_SQUARES + 1);
+  }
+
+  return data;
 }
 
-static void profile_top_95_puzzles() {
-  if (profile_puzzles(TOP_95_PUZZLES, TOP_95_COUNT)) {
-    printf("Solved 50 of 50 easy puzzles\n");
+// Benchmarks the puzzles in path, or the three bundled corpora if path is
+// NULL, once for each setting options ask to run in turn. first is set
+// until a result is printed, so all runs share one CSV header or JSON array.
+static _Bool run_benchmark_settings(const char *path, const struct benchmark_options *options, _Bool *first) {
+  if (options->all_propagation_levels) {
+    struct benchmark_options level_options = *options;
+    const enum propagation chosen = propagation;
+    _Bool ok = true;
+
+    level_options.all_propagation_levels = false;
+
+    for (int level = 0; level < PROPAGATION_COUNT && ok; ++level) {
+      propagation = (enum propagation)level;
+      ok = run_benchmark_settings(path, &level_options, first);
+    }
+
+    propagation = chosen;
+
+    return ok;
+  }
+
+  if (options->all_value_orders) {
+    struct benchmark_options order_options = *options;
+    const enum value_order chosen = value_order;
+    _Bool ok = true;
+
+    order_options.all_value_orders = false;
+
+    for (int order = 0; order < VALUE_ORDER_COUNT && ok; ++order) {
+      value_order = (enum value_order)order;
+      ok = run_benchmark_settings(path, &order_options, first);
+    }
+
+    value_order = chosen;
+
+    return ok;
+  }
+
+  if (options->all_branchings) {
+    struct benchmark_options branching_options = *options;
+    const enum branching chosen = branching;
+    _Bool ok = true;
+
+    branching_options.all_branchings = false;
+
+    for (int choice = 0; choice < BRANCHING_COUNT && ok; ++choice) {
+      branching = (enum branching)choice;
+      ok = run_benchmark_settings(path, &branching_options, first);
+    }
+
+    branching = chosen;
+
+    return ok;
+  }
+
+  struct benchmark_result result;
+
+  if (path == NULL) {
+    const char *const *corpora[] = { EASY_50_PUZZLES, HARDEST_11_PUZZLES, TOP_95_PUZZLES };
+    const int counts[] = { EASY_50_COUNT, HARDEST_11_COUNT, TOP_95_COUNT };
+    const char *names[] = { "easy-50", "hardest-11", "top-95" };
+
+    for (int i = 0; i < 3; ++i) {
+      result.name = names[i];
+
+      if (!benchmark_puzzles(corpora[i], counts[i], options, &result)) {
+	return false;
+      }
+
+      print_benchmark_result(&result, options, *first);
+      *first = false;
+    }
+  }
+  else {
+    const char **puzzles = NULL;
+    int count = 0;
+    char *data = read_puzzles(path, &puzzles, &count);
+
+    if (data == NULL) {
+      return false;
+    }
+
+    result.name = path;
+
+    const _Bool ok = benchmark_puzzles(puzzles, count, options, &result);
+
+    free(puzzles);
+    free(data);
+
+    if (!ok) {
+      return false;
+    }
+
+    print_benchmark_result(&result, options, *first);
+    *first = false;
   }
+
+  return true;
 }
 
-static void profile_example_puzzles() {
-  profile_easy_50_puzzles();
-  profile_hardest_11_puzzles();
-  profile_top_95_puzzles();
+static _Bool run_benchmark(const char *path, const struct benchmark_options *options) {
+  _Bool first = true;
+  const _Bool ok = run_benchmark_settings(path, options, &first);
+
+  if (options->format == BENCHMARK_JSON && !first) {
+    printf("\n]\n");
+  }
+
+  return ok;
 }
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef SUDOKU_H
+#define SUDOKU_H
+
+/*
+
+  libsudoku
+
+  Build sudoku.c with -DSUDOKU_LIBRARY to leave out main and the command
+  line tools, and link the object into a static or shared library:
+
+    cc -O2 -fPIC -pthread -DSUDOKU_LIBRARY -c sudoku.c -o sudoku.o
+    ar rcs libsudoku.a sudoku.o
+    cc -shared -pthread -o libsudoku.so sudoku.o
+
+  Puzzles are 81 characters, row by row, with '1' to '9' for clues and '.'
+  or '0' for empty squares. They need not be NUL terminated. Every function
+  is thread safe, and none of them prints anything.
+
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SUDOKU_SQUARES 81
+
+enum sudoku_status {
+  SUDOKU_SOLVED = 0,
+  // The clues contradict each other, or leave no way to fill the grid.
+  SUDOKU_NO_SOLUTION,
+  // A character other than a clue or an empty square.
+  SUDOKU_INVALID_INPUT,
+  // The search ran out of nodes or time before it could tell.
+  SUDOKU_TIMED_OUT,
+};
+
+// Solves puzzle, writing the 81 characters of its solution to solution.
+// When there is none, solution gets '.' in every square.
+enum sudoku_status sudoku_solve(const char *puzzle, char *solution);
+
+// Solves puzzle as sudoku_solve does, but gives up after max_nodes search
+// nodes or max_seconds, where zero means no limit. On SUDOKU_TIMED_OUT,
+// solution holds the squares that propagation solved and '.' for the rest,
+// which can be retried with a larger budget.
+enum sudoku_status sudoku_solve_limited(const char *puzzle, char *solution, unsigned long long max_nodes,
+					double max_seconds);
+
+// Solves n puzzles stored back to back, 81 characters each, writing their
+// solutions back to back to out as sudoku_solve does. If statuses is not
+// NULL it receives the status of each puzzle. Returns the number solved.
+size_t sudoku_solve_batch(const char *puzzles, size_t n, char *out, enum sudoku_status *statuses);
+
+// Counts the solutions of puzzle, stopping at limit. A limit of two tells
+// whether the solution is unique. Returns -1 for invalid input.
+int sudoku_count_solutions(const char *puzzle, int limit);
+
+const char *sudoku_status_name(enum sudoku_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,402 @@
+/*
+
+  N×N Engine
+
+  sudoku.c includes this file once per box size, with BOX defined, to get a
+  solver for grids of BOX² × BOX² squares. Each inclusion defines
+  box<BOX>_solve, box<BOX>_solve_line and box<BOX>_count_solutions. The
+  search is the norvig engine's, with its trail, worklist propagation and
+  hidden singles. Rows, columns and boxes are walked with strides that are
+  constants for the size, so no peer or unit tables are needed. Values are
+  bits of a 16 bit mask up to 16×16 and of a 32 bit mask above that.
+
+  Squares hold symbols from SYMBOLS, with '.' or '0' for an empty square.
+
+ */
+
+#ifndef BOX
+#error "BOX must be defined before including sudoku_nxn.h"
+#endif
+
+#define NXN_PASTE(size, name) box ## size ## _ ## name
+#define NXN_EXPAND(size, name) NXN_PASTE(size, name)
+#define NXN(name) NXN_EXPAND(BOX, name)
+
+#define NXN_SIZE (BOX * BOX)
+#define NXN_SQUARES (NXN_SIZE * NXN_SIZE)
+#define NXN_UNITS (3 * NXN_SIZE)
+#define NXN_PEERS (2 * (NXN_SIZE - 1) + (BOX - 1) * (BOX - 1))
+#define NXN_ALL_VALUES ((NXN(values))((1ULL << NXN_SIZE) - 1))
+
+#if BOX <= 4
+typedef uint16_t NXN(values);
+#else
+typedef uint32_t NXN(values);
+#endif
+
+// As in the norvig engine, a logged write always removes values from a
+// square and never empties it.
+#define NXN_TRAIL_SIZE (NXN_SQUARES * (NXN_SIZE - 1))
+
+struct NXN(trail_entry) {
+  uint16_t square;
+  NXN(values) values;
+};
+
+struct NXN(search_frame) {
+  uint16_t square;
+  NXN(values) values_left;
+  int mark;
+};
+
+struct NXN(solver) {
+  NXN(values) grid[NXN_SQUARES];
+  int trail_size;
+  struct NXN(trail_entry) trail[NXN_TRAIL_SIZE];
+  struct NXN(search_frame) stack[NXN_SQUARES];
+};
+
+static inline void NXN(default_grid_values)(NXN(values) grid[NXN_SQUARES]) {
+  for (int i = 0; i < NXN_SQUARES; ++i) {
+    grid[i] = NXN_ALL_VALUES;
+  }
+}
+
+static inline void NXN(set_values)(struct NXN(solver) *solver, int square, NXN(values) values) {
+  struct NXN(trail_entry) *entry = &solver->trail[solver->trail_size++];
+
+  entry->square = (uint16_t)square;
+  entry->values = solver->grid[square];
+  solver->grid[square] = values;
+}
+
+static inline void NXN(undo)(struct NXN(solver) *solver, int mark) {
+  while (solver->trail_size > mark) {
+    const struct NXN(trail_entry) *entry = &solver->trail[--solver->trail_size];
+    solver->grid[entry->square] = entry->values;
+  }
+}
+
+// Clears value from square, queueing the square if it is left with a
+// single value. Fails if it is left with none.
+static inline _Bool NXN(eliminate)(struct NXN(solver) *solver, int square, NXN(values) value,
+				   uint16_t queue[NXN_SQUARES], int *queued) {
+  NXN(values) values = solver->grid[square];
+
+  if ((values & value) == 0) {
+    return true;
+  }
+
+  values &= (NXN(values))~value;
+
+  if (values == 0) {
+    return false;
+  }
+
+  NXN(set_values)(solver, square, values);
+
+  if ((values & (values - 1)) == 0) {
+    queue[(*queued)++] = (uint16_t)square;
+    STATS_MAX(max_queue, *queued);
+  }
+
+  return true;
+}
+
+// Clears the value of each queued square from its row, its column and the
+// rest of its box, until the queue runs dry.
+static _Bool NXN(propagate)(struct NXN(solver) *solver, uint16_t queue[NXN_SQUARES], int queued) {
+  for (int next = 0; next < queued; ++next) {
+    const int square = queue[next];
+    const NXN(values) value = solver->grid[square];
+    const int row = square / NXN_SIZE;
+    const int column = square % NXN_SIZE;
+    const int box_row = row - row % BOX;
+    const int box_column = column - column % BOX;
+
+    STATS_ADD(propagations, 1);
+    STATS_ADD(peer_scans, NXN_PEERS);
+
+    for (int i = 0; i < NXN_SIZE; ++i) {
+      if (i != column && !NXN(eliminate)(solver, row * NXN_SIZE + i, value, queue, &queued)) {
+	return false;
+      }
+
+      if (i != row && !NXN(eliminate)(solver, i * NXN_SIZE + column, value, queue, &queued)) {
+	return false;
+      }
+    }
+
+    for (int r = box_row; r < box_row + BOX; ++r) {
+      if (r == row) {
+	continue;
+      }
+
+      for (int c = box_column; c < box_column + BOX; ++c) {
+	if (c != column && !NXN(eliminate)(solver, r * NXN_SIZE + c, value, queue, &queued)) {
+	  return false;
+	}
+      }
+    }
+  }
+
+  return true;
+}
+
+// Rows, then columns, then boxes, in the order of UNITS.
+static inline int NXN(unit_square)(int unit, int i) {
+  if (unit < NXN_SIZE) {
+    return unit * NXN_SIZE + i;
+  }
+
+  if (unit < 2 * NXN_SIZE) {
+    return i * NXN_SIZE + unit - NXN_SIZE;
+  }
+
+  const int box = unit - 2 * NXN_SIZE;
+
+  return (box / BOX * BOX + i / BOX) * NXN_SIZE + box % BOX * BOX + i % BOX;
+}
+
+static _Bool NXN(place_hidden_singles)(struct NXN(solver) *solver) {
+  const NXN(values) *grid = solver->grid;
+  uint16_t queue[NXN_SQUARES];
+  int queued;
+
+  do {
+    queued = 0;
+
+    for (int unit = 0; unit < NXN_UNITS; ++unit) {
+      int squares[NXN_SIZE];
+      NXN(values) once = 0;
+      NXN(values) twice = 0;
+      NXN(values) solved = 0;
+
+      for (int i = 0; i < NXN_SIZE; ++i) {
+	squares[i] = NXN(unit_square)(unit, i);
+
+	const NXN(values) values = grid[squares[i]];
+
+	twice |= once & values;
+	once |= values;
+
+	if ((values & (values - 1)) == 0) {
+	  solved |= values;
+	}
+      }
+
+      if (once != NXN_ALL_VALUES) {
+	return false;
+      }
+
+      NXN(values) hidden = once & ~twice & ~solved;
+
+      while (hidden != 0) {
+	const NXN(values) value = hidden & -hidden;
+	hidden &= hidden - 1;
+
+	int i = 0;
+
+	while (i < NXN_SIZE && (grid[squares[i]] & value) == 0) {
+	  ++i;
+	}
+
+	if (i == NXN_SIZE) {
+	  return false;
+	}
+
+	if (grid[squares[i]] != value) {
+	  NXN(set_values)(solver, squares[i], value);
+	  queue[queued++] = (uint16_t)squares[i];
+	}
+      }
+    }
+
+    STATS_ADD(hidden_singles, queued);
+
+    if (!NXN(propagate)(solver, queue, queued)) {
+      return false;
+    }
+  } while (queued > 0);
+
+  return true;
+}
+
+static _Bool NXN(assign)(struct NXN(solver) *solver, int square, NXN(values) value) {
+  uint16_t queue[NXN_SQUARES];
+
+  STATS_ADD(assigns, 1);
+
+  queue[0] = (uint16_t)square;
+  NXN(set_values)(solver, square, value);
+
+  return NXN(propagate)(solver, queue, 1) && NXN(place_hidden_singles)(solver);
+}
+
+static _Bool NXN(search_target)(const NXN(values) grid[NXN_SQUARES], int *square) {
+  const int none_found = NXN_SIZE + 1;
+  int min_remaining = none_found;
+  int min_square = 0;
+
+  for (int i = 0; i < NXN_SQUARES; ++i) {
+    const int values_remaining = __builtin_popcount(grid[i]);
+
+    if (values_remaining > 1 && values_remaining < min_remaining) {
+      min_remaining = values_remaining;
+      min_square = i;
+
+      if (values_remaining == 2) {
+	break;
+      }
+    }
+  }
+
+  if (min_remaining == none_found) {
+    return false;
+  }
+
+  *square = min_square;
+
+  return true;
+}
+
+static inline void NXN(push_frame)(struct NXN(solver) *solver, int depth, int square) {
+  struct NXN(search_frame) *frame = &solver->stack[depth];
+
+  frame->square = (uint16_t)square;
+  frame->values_left = solver->grid[square];
+  frame->mark = solver->trail_size;
+}
+
+// The same search as search_solutions, without cancellation.
+static int NXN(search_solutions)(struct NXN(solver) *solver, int limit) {
+  int square = 0;
+
+  STATS_ADD(nodes, 1);
+
+  if (!NXN(search_target)(solver->grid, &square)) {
+    return 1;
+  }
+
+  NXN(push_frame)(solver, 0, square);
+  int depth = 1;
+  int found = 0;
+
+  while (depth > 0) {
+    struct NXN(search_frame) *frame = &solver->stack[depth - 1];
+    NXN(undo)(solver, frame->mark);
+
+    if (frame->values_left == 0) {
+      --depth;
+      continue;
+    }
+
+    const NXN(values) value = frame->values_left & -frame->values_left;
+    frame->values_left &= (NXN(values))~value;
+
+    STATS_ADD(guesses, 1);
+
+    if (!NXN(assign)(solver, frame->square, value)) {
+      STATS_ADD(backtracks, 1);
+      continue;
+    }
+
+    STATS_ADD(nodes, 1);
+    STATS_MAX(max_depth, depth);
+
+    if (!NXN(search_target)(solver->grid, &square)) {
+      if (++found == limit) {
+	return found;
+      }
+
+      continue;
+    }
+
+    NXN(push_frame)(solver, depth++, square);
+  }
+
+  return found;
+}
+
+static _Bool NXN(assign_puzzle)(const char *puzzle, struct NXN(solver) *solver) {
+  uint16_t queue[NXN_SQUARES];
+  int queued = 0;
+
+  for (int i = 0; i < NXN_SQUARES; ++i) {
+    const char symbol = puzzle[i];
+
+    if (symbol == '.' || symbol == '0') {
+      continue;
+    }
+
+    const int value = symbol_value(symbol);
+
+    if (value < 0 || value >= NXN_SIZE) {
+      return false;
+    }
+
+    NXN(set_values)(solver, i, (NXN(values))(1u << value));
+    queue[queued++] = (uint16_t)i;
+  }
+
+  STATS_ADD(assigns, queued);
+
+  return NXN(propagate)(solver, queue, queued) && NXN(place_hidden_singles)(solver);
+}
+
+static inline void NXN(init_solver)(struct NXN(solver) *solver, const NXN(values) grid[NXN_SQUARES]) {
+  memcpy(solver->grid, grid, sizeof(solver->grid));
+  solver->trail_size = 0;
+}
+
+// Like solve, starting from the values in grid and leaving the result there.
+static _Bool NXN(solve)(const char *puzzle, NXN(values) grid[NXN_SQUARES]) {
+  STATS_RESET();
+
+  struct NXN(solver) solver;
+  NXN(init_solver)(&solver, grid);
+
+  const _Bool solved = NXN(assign_puzzle)(puzzle, &solver) && NXN(search_solutions)(&solver, 1) == 1;
+  memcpy(grid, solver.grid, sizeof(solver.grid));
+
+  return solved;
+}
+
+// Writes the symbols of the solution of puzzle to solution, if it has one.
+static _Bool NXN(solve_line)(const char *puzzle, char *solution) {
+  NXN(values) grid[NXN_SQUARES];
+  NXN(default_grid_values)(grid);
+
+  if (!NXN(solve)(puzzle, grid)) {
+    return false;
+  }
+
+  for (int i = 0; i < NXN_SQUARES; ++i) {
+    solution[i] = SYMBOLS[__builtin_ctz(grid[i])];
+  }
+
+  return true;
+}
+
+static int NXN(count_solutions)(const char *puzzle, int limit) {
+  STATS_RESET();
+
+  NXN(values) grid[NXN_SQUARES];
+  NXN(default_grid_values)(grid);
+
+  struct NXN(solver) solver;
+  NXN(init_solver)(&solver, grid);
+
+  return NXN(assign_puzzle)(puzzle, &solver) ? NXN(search_solutions)(&solver, limit) : 0;
+}
+
+#undef NXN_TRAIL_SIZE
+#undef NXN_ALL_VALUES
+#undef NXN_PEERS
+#undef NXN_UNITS
+#undef NXN_SQUARES
+#undef NXN_SIZE
+#undef NXN
+#undef NXN_EXPAND
+#undef NXN_PASTE
+#undef BOX